@@ -0,0 +1,707 @@
+/*
+ * This file is part of mverse
+ * Copyright (C) 2022  juanvalencia.xyz
+
+ * mverse is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "bvh.h"
+
+/*
+ * Growable node array, every subtree built by a thread has its own
+ */
+struct BvhNodes {
+    BvhNode *data;
+    unsigned int size, capacity, depth;
+};
+
+/*
+ * Subtree left for the threads, node is its root in the shared array
+ */
+struct BvhTask {
+    unsigned int node, first, count, depth;
+    struct BvhNodes nodes;
+};
+
+/*
+ * Node waiting to be split and the bounds of the centroids of its items
+ */
+struct BvhEntry {
+    unsigned int node, depth;
+    float centroid[6];
+};
+
+struct BvhBuild {
+    float (*box)[6];            /* min then max of items[i], moved with it */
+    unsigned int *items;
+    struct BvhTask *tasks;
+    unsigned int taskSize, taskCapacity, next;
+    pthread_mutex_t lock;
+};
+
+static void bvhGrow(struct BvhBuild *b, struct BvhNodes *nodes, unsigned int minCount);
+static unsigned int bvhSplit(struct BvhBuild *b, BvhNode *node, const float *centroid, float (*child)[6], float (*childCentroid)[6]);
+static void bvhBounds(struct BvhBuild *b, unsigned int first, unsigned int count, float *box, float *centroid);
+static unsigned int bvhBin(const float *box, unsigned int axis, float origin, float scale, unsigned int bins);
+static void * bvhWorker(void *build);
+static unsigned int nodesAdd(struct BvhNodes *nodes, unsigned int n);
+static void taskAdd(struct BvhBuild *b, unsigned int node, const BvhNode *data, unsigned int depth);
+static void itemBox(const Bvh *bvh, const Obj *obj, unsigned int item, float *min, float *max);
+static float boxArea(const float *min, const float *max);
+static int boxClassify(const Frustum *frustum, const float *min, const float *max);
+static int rayBox(const float *origin, const float *inv, const float *min, const float *max, float tMax, float *tNear);
+static int rayTriangle(const float *origin, const float *dir, const float *p0, const float *p1, const float *p2, float *t);
+
+/*
+ * Build the hierarchy over the meshes of obj, or over its triangles, by
+ * binned SAH splits. The top of the tree is split here until there are
+ * enough subtrees for nThreads threads to finish, 0 uses one per CPU.
+ * Prints the time and memory the build took
+ */
+Bvh
+bvhBuild(const Obj *obj, int triangles, int nThreads)
+{
+    struct BvhBuild b;
+    struct BvhNodes nodes;
+    struct BvhTask *task;
+    struct timespec t0, t1;
+    pthread_t *threads;
+    BvhNode *node;
+    Bvh bvh;
+    unsigned int i, j, k, n, base;
+    const float *p;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    n = (triangles) ? obj->indexSize / 3 : obj->size;
+    b.box = (float (*)[6])malloc((n + 1) * sizeof(*b.box));
+    b.items = (unsigned int *)malloc((n + 1) * sizeof(unsigned int));
+    if (b.box == NULL || b.items == NULL) {
+        perror("bvhBuild() Error");
+        exit(1);
+    }
+
+    memset(&bvh, 0, sizeof(bvh));
+    bvh.triangles = triangles;
+    for (i = k = 0; i < n; i++) {
+        if (!triangles && !obj->mesh[i].indexSize) continue;
+        b.items[k] = i;
+        if (!triangles) {
+            memcpy(b.box[k], obj->mesh[i].min, sizeof(obj->mesh[i].min));
+            memcpy(b.box[k++] + 3, obj->mesh[i].max, sizeof(obj->mesh[i].max));
+            continue;
+        }
+        for (j = 0; j < 3; j++) {
+            b.box[k][j] = INFINITY;
+            b.box[k][j + 3] = -INFINITY;
+        }
+        for (j = 0; j < 9; j++) {
+            p = obj->vertices[obj->indices[3 * i + j / 3]].position;
+            if (p[j % 3] < b.box[k][j % 3]) b.box[k][j % 3] = p[j % 3];
+            if (p[j % 3] > b.box[k][j % 3 + 3]) b.box[k][j % 3 + 3] = p[j % 3];
+        }
+        k++;
+    }
+    bvh.itemSize = k;
+
+    memset(&nodes, 0, sizeof(nodes));
+    nodesAdd(&nodes, 1);
+    nodes.data[0].first = 0;
+    nodes.data[0].count = k;
+
+    b.tasks = NULL;
+    b.taskSize = b.taskCapacity = b.next = 0;
+    if (nThreads <= 0) nThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    bvhGrow(&b, &nodes, (nThreads > 1 && k >= BVH_THREAD_MIN) ? k / (4 * nThreads) : 0);
+
+    if (b.taskSize) {
+        threads = (pthread_t *)malloc(nThreads * sizeof(pthread_t));
+        if (threads == NULL || pthread_mutex_init(&b.lock, NULL)) {
+            perror("bvhBuild() Error");
+            exit(1);
+        }
+        for (i = 0; i < (unsigned int)nThreads; i++) {
+            if (pthread_create(threads + i, NULL, bvhWorker, &b)) {
+                perror("bvhBuild() Error");
+                exit(1);
+            }
+        }
+        for (i = 0; i < (unsigned int)nThreads; i++)
+            pthread_join(threads[i], NULL);
+        pthread_mutex_destroy(&b.lock);
+        free(threads);
+
+        /* The subtree root takes the place of its task, the rest is appended */
+        for (i = 0; i < b.taskSize; i++) {
+            task = b.tasks + i;
+            base = nodesAdd(&nodes, task->nodes.size - 1);
+            for (j = 0; j < task->nodes.size; j++) {
+                node = task->nodes.data + j;
+                if (node->left) node->left += base - 1;
+                nodes.data[(j) ? base + j - 1 : task->node] = *node;
+            }
+            if (task->depth + task->nodes.depth > nodes.depth)
+                nodes.depth = task->depth + task->nodes.depth;
+            free(task->nodes.data);
+        }
+    }
+
+    bvh.nodes = (BvhNode *)realloc(nodes.data, nodes.size * sizeof(BvhNode));
+    if (bvh.nodes == NULL) {
+        perror("bvhBuild() Error");
+        exit(1);
+    }
+    bvh.items = b.items;
+    bvh.size = nodes.size;
+    bvh.depth = nodes.depth;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    fprintf(stderr, "bvhBuild(): %u %s, %u nodes, depth %u, %.3f s, %.1f MB (%.1f MB more while building)\n",
+            bvh.itemSize, (triangles) ? "triangles" : "meshes", bvh.size, bvh.depth,
+            (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9,
+            (nodes.size * sizeof(BvhNode) + (n + 1) * sizeof(unsigned int)) / 1048576.0,
+            (n + 1) * sizeof(*b.box) / 1048576.0);
+
+    free(b.box);
+    free(b.tasks);
+    return bvh;
+}
+
+/*
+ * Set visible[item] for the items of bvh whose box touches the frustum,
+ * the items under a node inside it are taken without more tests
+ */
+void
+bvhCull(const Bvh *bvh, const Obj *obj, const Frustum *frustum, unsigned char *visible)
+{
+    const BvhNode *node;
+    unsigned int *stack, size, i;
+    float min[3], max[3];
+    int inside;
+
+    if (!bvh->itemSize) return;
+
+    stack = (unsigned int *)malloc((bvh->depth + 2) * sizeof(unsigned int));
+    if (stack == NULL) {
+        perror("bvhCull() Error");
+        exit(1);
+    }
+
+    stack[0] = 0;
+    size = 1;
+    while (size) {
+        node = bvh->nodes + stack[--size];
+        inside = boxClassify(frustum, node->min, node->max);
+        if (inside < 0) continue;
+
+        if (inside == 0 && node->left) {
+            stack[size++] = node->left;
+            stack[size++] = node->left + 1;
+            continue;
+        }
+
+        for (i = node->first; i < node->first + node->count; i++) {
+            if (inside == 0) {
+                itemBox(bvh, obj, bvh->items[i], min, max);
+                if (boxClassify(frustum, min, max) < 0) continue;
+            }
+            visible[bvh->items[i]] = 1;
+        }
+    }
+    free(stack);
+}
+
+/*
+ * Find the closest triangle origin + t * dir hits with t > 0, nearer
+ * children are visited first. Return 1 on a hit and leave t and the first
+ * index of the triangle in index
+ */
+int
+bvhRay(const Bvh *bvh, const Obj *obj, const float *origin, const float *dir, float *t, unsigned int *index)
+{
+    const BvhNode *node, *child;
+    const float *p[3];
+    unsigned int *stack, size, i, first, end, j, k;
+    float inv[3], best, hit, tNear[2];
+    int found;
+
+    if (!bvh->itemSize) return 0;
+
+    stack = (unsigned int *)malloc((bvh->depth + 2) * sizeof(unsigned int));
+    if (stack == NULL) {
+        perror("bvhRay() Error");
+        exit(1);
+    }
+
+    for (j = 0; j < 3; j++)
+        inv[j] = 1 / dir[j];
+
+    found = 0;
+    best = INFINITY;
+    stack[0] = 0;
+    size = 1;
+    while (size) {
+        node = bvh->nodes + stack[--size];
+        if (!rayBox(origin, inv, node->min, node->max, best, tNear)) continue;
+
+        if (node->left) {
+            child = bvh->nodes + node->left;
+            k = rayBox(origin, inv, child[0].min, child[0].max, best, tNear)
+                | rayBox(origin, inv, child[1].min, child[1].max, best, tNear + 1) << 1;
+            if (k == 3 && tNear[0] < tNear[1]) {
+                stack[size++] = node->left + 1;
+                stack[size++] = node->left;
+            } else {
+                if (k & 1) stack[size++] = node->left;
+                if (k & 2) stack[size++] = node->left + 1;
+            }
+            continue;
+        }
+
+        for (i = node->first; i < node->first + node->count; i++) {
+            first = (bvh->triangles) ? 3 * bvh->items[i] : obj->mesh[bvh->items[i]].indexOffset;
+            end = (bvh->triangles) ? first + 3 : first + obj->mesh[bvh->items[i]].indexSize;
+            for (; first + 2 < end; first += 3) {
+                for (j = 0; j < 3; j++)
+                    p[j] = obj->vertices[obj->indices[first + j]].position;
+                if (rayTriangle(origin, dir, p[0], p[1], p[2], &hit) && hit < best) {
+                    best = hit;
+                    *index = first;
+                    found = 1;
+                }
+            }
+        }
+    }
+
+    free(stack);
+    *t = best;
+    return found;
+}
+
+void
+bvhFree(Bvh *bvh)
+{
+    free(bvh->nodes);
+    free(bvh->items);
+    memset(bvh, 0, sizeof(*bvh));
+}
+
+/*
+ * Split the nodes from nodes->data[0] down until every leaf is small
+ * enough or not worth splitting. With minCount, nodes with fewer items
+ * are left as tasks for the threads
+ */
+void
+bvhGrow(struct BvhBuild *b, struct BvhNodes *nodes, unsigned int minCount)
+{
+    struct BvhEntry *stack, e;
+    BvhNode *node;
+    unsigned int size, capacity, i, mid, left;
+    float box[6], child[2][6], childCentroid[2][6];
+
+    capacity = 64;
+    stack = (struct BvhEntry *)malloc(capacity * sizeof(struct BvhEntry));
+    if (stack == NULL) {
+        perror("bvhGrow() Error");
+        exit(1);
+    }
+
+    node = nodes->data;
+    bvhBounds(b, node->first, node->count, box, stack[0].centroid);
+    memcpy(node->min, box, sizeof(node->min));
+    memcpy(node->max, box + 3, sizeof(node->max));
+    stack[0].node = stack[0].depth = 0;
+    size = 1;
+
+    while (size) {
+        e = stack[--size];
+        if (e.depth > nodes->depth) nodes->depth = e.depth;
+
+        node = nodes->data + e.node;
+        node->left = 0;
+        if (node->count <= BVH_LEAF_SIZE) continue;
+        if (node->count < minCount) {
+            taskAdd(b, e.node, node, e.depth);
+            continue;
+        }
+
+        mid = bvhSplit(b, node, e.centroid, child, childCentroid);
+        if (!mid) continue;
+
+        left = nodesAdd(nodes, 2);
+        node = nodes->data + e.node;
+        node->left = left;
+        nodes->data[left].first = node->first;
+        nodes->data[left].count = mid;
+        nodes->data[left + 1].first = node->first + mid;
+        nodes->data[left + 1].count = node->count - mid;
+
+        if (size + 2 > capacity) {
+            capacity *= 2;
+            stack = (struct BvhEntry *)realloc(stack, capacity * sizeof(struct BvhEntry));
+            if (stack == NULL) {
+                perror("bvhGrow() Error");
+                exit(1);
+            }
+        }
+        for (i = 0; i < 2; i++) {
+            memcpy(nodes->data[left + i].min, child[i], sizeof(node->min));
+            memcpy(nodes->data[left + i].max, child[i] + 3, sizeof(node->max));
+            stack[size].node = left + i;
+            stack[size].depth = e.depth + 1;
+            memcpy(stack[size++].centroid, childCentroid[i], sizeof(e.centroid));
+        }
+    }
+    free(stack);
+}
+
+/*
+ * Sort the items of node around the cheapest of up to BVH_BINS planes
+ * across the widest axis of their centroids, by the surface area
+ * heuristic (Wald, "On fast Construction of SAH-based Bounding Volume
+ * Hierarchies"). Return how many go left, 0 when the node is better off
+ * as a leaf, and the bounds of both sides in child and childCentroid
+ */
+unsigned int
+bvhSplit(struct BvhBuild *b, BvhNode *node, const float *centroid, float (*child)[6], float (*childCentroid)[6])
+{
+    unsigned int binCount[BVH_BINS], leftCount[BVH_BINS];
+    float binBox[BVH_BINS][6], binCentroid[BVH_BINS][6], leftArea[BVH_BINS];
+    float box[6], swapBox[6], scale, cost, bestCost, c;
+    unsigned int i, j, k, n, axis, bin, bins, bestBin, swap, first, count;
+    const float *item;
+
+    first = node->first;
+    count = node->count;
+    axis = 0;
+    for (j = 1; j < 3; j++)
+        if (centroid[j + 3] - centroid[j] > centroid[axis + 3] - centroid[axis]) axis = j;
+
+    bins = (count < BVH_BINS) ? count : BVH_BINS;
+    scale = (centroid[axis + 3] > centroid[axis]) ? bins / (centroid[axis + 3] - centroid[axis]) : 0;
+    for (k = 0; k < bins; k++) {
+        binCount[k] = 0;
+        for (j = 0; j < 3; j++) {
+            binBox[k][j] = binCentroid[k][j] = INFINITY;
+            binBox[k][j + 3] = binCentroid[k][j + 3] = -INFINITY;
+        }
+    }
+
+    for (i = first; i < first + count && scale > 0; i++) {
+        item = b->box[i];
+        bin = bvhBin(item, axis, centroid[axis], scale, bins);
+        binCount[bin]++;
+        for (j = 0; j < 3; j++) {
+            if (item[j] < binBox[bin][j]) binBox[bin][j] = item[j];
+            if (item[j + 3] > binBox[bin][j + 3]) binBox[bin][j + 3] = item[j + 3];
+            c = (item[j] + item[j + 3]) / 2;
+            if (c < binCentroid[bin][j]) binCentroid[bin][j] = c;
+            if (c > binCentroid[bin][j + 3]) binCentroid[bin][j + 3] = c;
+        }
+    }
+
+    /* Sweep from the left keeping the sides, then from the right */
+    bestCost = INFINITY;
+    bestBin = 0;
+    for (k = 0; k < 2 && scale > 0; k++) {
+        for (j = 0; j < 3; j++) {
+            box[j] = INFINITY;
+            box[j + 3] = -INFINITY;
+        }
+        for (i = 0, n = 0; i + 1 < bins; i++) {
+            bin = (k) ? bins - 1 - i : i;
+            n += binCount[bin];
+            for (j = 0; j < 3; j++) {
+                if (binBox[bin][j] < box[j]) box[j] = binBox[bin][j];
+                if (binBox[bin][j + 3] > box[j + 3]) box[j + 3] = binBox[bin][j + 3];
+            }
+
+            if (!k) {
+                leftCount[i] = n;
+                leftArea[i] = (n) ? boxArea(box, box + 3) : 0;
+                continue;
+            }
+            /* bins below bin go left */
+            if (!n || !leftCount[bin - 1]) continue;
+            cost = leftArea[bin - 1] * leftCount[bin - 1] + boxArea(box, box + 3) * n;
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestBin = bin;
+            }
+        }
+    }
+
+    /* No plane separates the centroids, only the item count can split them */
+    if (!bestBin) {
+        if (count <= BVH_LEAF_MAX) return 0;
+        n = count / 2;
+        bvhBounds(b, first, n, child[0], childCentroid[0]);
+        bvhBounds(b, first + n, count - n, child[1], childCentroid[1]);
+        return n;
+    }
+    if (bestCost >= boxArea(node->min, node->max) * count && count <= BVH_LEAF_MAX) return 0;
+
+    for (i = first, j = first + count; i < j;) {
+        if (bvhBin(b->box[i], axis, centroid[axis], scale, bins) < bestBin) {
+            i++;
+            continue;
+        }
+        j--;
+        swap = b->items[i];
+        b->items[i] = b->items[j];
+        b->items[j] = swap;
+        memcpy(swapBox, b->box[i], sizeof(swapBox));
+        memcpy(b->box[i], b->box[j], sizeof(swapBox));
+        memcpy(b->box[j], swapBox, sizeof(swapBox));
+    }
+
+    for (k = 0; k < 2; k++) {
+        for (j = 0; j < 3; j++) {
+            child[k][j] = childCentroid[k][j] = INFINITY;
+            child[k][j + 3] = childCentroid[k][j + 3] = -INFINITY;
+        }
+    }
+    for (bin = 0; bin < bins; bin++) {
+        k = (bin >= bestBin);
+        for (j = 0; j < 3; j++) {
+            child[k][j] = fminf(child[k][j], binBox[bin][j]);
+            child[k][j + 3] = fmaxf(child[k][j + 3], binBox[bin][j + 3]);
+            childCentroid[k][j] = fminf(childCentroid[k][j], binCentroid[bin][j]);
+            childCentroid[k][j + 3] = fmaxf(childCentroid[k][j + 3], binCentroid[bin][j + 3]);
+        }
+    }
+    return i - first;
+}
+
+/*
+ * Box of the items from first on and the box of their centroids
+ */
+void
+bvhBounds(struct BvhBuild *b, unsigned int first, unsigned int count, float *box, float *centroid)
+{
+    unsigned int i, j;
+    float c;
+
+    for (j = 0; j < 3; j++) {
+        box[j] = centroid[j] = INFINITY;
+        box[j + 3] = centroid[j + 3] = -INFINITY;
+    }
+    for (i = first; i < first + count; i++) {
+        for (j = 0; j < 3; j++) {
+            if (b->box[i][j] < box[j]) box[j] = b->box[i][j];
+            if (b->box[i][j + 3] > box[j + 3]) box[j + 3] = b->box[i][j + 3];
+            c = (b->box[i][j] + b->box[i][j + 3]) / 2;
+            if (c < centroid[j]) centroid[j] = c;
+            if (c > centroid[j + 3]) centroid[j + 3] = c;
+        }
+    }
+}
+
+unsigned int
+bvhBin(const float *box, unsigned int axis, float origin, float scale, unsigned int bins)
+{
+    float bin = ((box[axis] + box[axis + 3]) / 2 - origin) * scale;
+
+    if (bin < 0) return 0;
+    return (bin < bins - 1) ? (unsigned int)bin : bins - 1;
+}
+
+void *
+bvhWorker(void *build)
+{
+    struct BvhBuild *b = (struct BvhBuild *)build;
+    struct BvhTask *task;
+    unsigned int i;
+
+    for (;;) {
+        pthread_mutex_lock(&b->lock);
+        i = b->next++;
+        pthread_mutex_unlock(&b->lock);
+        if (i >= b->taskSize) return NULL;
+
+        task = b->tasks + i;
+        memset(&task->nodes, 0, sizeof(task->nodes));
+        nodesAdd(&task->nodes, 1);
+        task->nodes.data[0].first = task->first;
+        task->nodes.data[0].count = task->count;
+        bvhGrow(b, &task->nodes, 0);
+    }
+}
+
+/*
+ * Append n nodes and return the first of them
+ */
+unsigned int
+nodesAdd(struct BvhNodes *nodes, unsigned int n)
+{
+    if (nodes->size + n > nodes->capacity) {
+        nodes->capacity = (nodes->capacity) ? 2 * nodes->capacity + n : n + 64;
+        nodes->data = (BvhNode *)realloc(nodes->data, nodes->capacity * sizeof(BvhNode));
+        if (nodes->data == NULL) {
+            perror("nodesAdd() Error");
+            exit(1);
+        }
+    }
+    nodes->size += n;
+    return nodes->size - n;
+}
+
+void
+taskAdd(struct BvhBuild *b, unsigned int node, const BvhNode *data, unsigned int depth)
+{
+    struct BvhTask *task;
+
+    if (b->taskSize == b->taskCapacity) {
+        b->taskCapacity = (b->taskCapacity) ? 2 * b->taskCapacity : 64;
+        b->tasks = (struct BvhTask *)realloc(b->tasks, b->taskCapacity * sizeof(struct BvhTask));
+        if (b->tasks == NULL) {
+            perror("taskAdd() Error");
+            exit(1);
+        }
+    }
+    task = b->tasks + b->taskSize++;
+    task->node = node;
+    task->first = data->first;
+    task->count = data->count;
+    task->depth = depth;
+}
+
+void
+itemBox(const Bvh *bvh, const Obj *obj, unsigned int item, float *min, float *max)
+{
+    const float *p;
+    unsigned int i, j;
+
+    if (!bvh->triangles) {
+        memcpy(min, obj->mesh[item].min, sizeof(obj->mesh[item].min));
+        memcpy(max, obj->mesh[item].max, sizeof(obj->mesh[item].max));
+        return;
+    }
+
+    for (j = 0; j < 3; j++) {
+        min[j] = INFINITY;
+        max[j] = -INFINITY;
+    }
+    for (i = 0; i < 3; i++) {
+        p = obj->vertices[obj->indices[3 * item + i]].position;
+        for (j = 0; j < 3; j++) {
+            if (p[j] < min[j]) min[j] = p[j];
+            if (p[j] > max[j]) max[j] = p[j];
+        }
+    }
+}
+
+/*
+ * Half the surface area of the box
+ */
+float
+boxArea(const float *min, const float *max)
+{
+    float d[3];
+    int j;
+
+    for (j = 0; j < 3; j++)
+        d[j] = max[j] - min[j];
+    return d[0] * d[1] + d[1] * d[2] + d[2] * d[0];
+}
+
+/*
+ * -1 when the box is outside the frustum, 1 inside and 0 across a plane
+ */
+int
+boxClassify(const Frustum *frustum, const float *min, const float *max)
+{
+    const float *p;
+    int i, inside = 1;
+
+    for (i = 0; i < 6; i++) {
+        p = frustum->plane[i];
+        if (p[0] * (p[0] > 0 ? max[0] : min[0]) + p[1] * (p[1] > 0 ? max[1] : min[1])
+            + p[2] * (p[2] > 0 ? max[2] : min[2]) + p[3] < 0)
+            return -1;
+        if (p[0] * (p[0] > 0 ? min[0] : max[0]) + p[1] * (p[1] > 0 ? min[1] : max[1])
+            + p[2] * (p[2] > 0 ? min[2] : max[2]) + p[3] < 0)
+            inside = 0;
+    }
+    return inside;
+}
+
+/*
+ * Slab test, inv holds 1 / dir. Whether the ray enters the box before
+ * tMax, and where in tNear. A ray parallel to a slab only has to start
+ * between its planes, 0 * inf would give NaN
+ */
+int
+rayBox(const float *origin, const float *inv, const float *min, const float *max, float tMax, float *tNear)
+{
+    float t0, t1, near = 0, far = tMax;
+    int j;
+
+    for (j = 0; j < 3; j++) {
+        if (isinf(inv[j])) {
+            if (origin[j] < min[j] || origin[j] > max[j]) return 0;
+            continue;
+        }
+        t0 = (min[j] - origin[j]) * inv[j];
+        t1 = (max[j] - origin[j]) * inv[j];
+        near = fmaxf(near, fminf(t0, t1));
+        far = fminf(far, fmaxf(t0, t1));
+    }
+    *tNear = near;
+    return near <= far;
+}
+
+/*
+ * Moller and Trumbore, both faces of the triangle are hit
+ */
+int
+rayTriangle(const float *origin, const float *dir, const float *p0, const float *p1, const float *p2, float *t)
+{
+    float e1[3], e2[3], s[3], pv[3], qv[3], det, u, v;
+    int j;
+
+    for (j = 0; j < 3; j++) {
+        e1[j] = p1[j] - p0[j];
+        e2[j] = p2[j] - p0[j];
+        s[j] = origin[j] - p0[j];
+    }
+    pv[0] = dir[1] * e2[2] - dir[2] * e2[1];
+    pv[1] = dir[2] * e2[0] - dir[0] * e2[2];
+    pv[2] = dir[0] * e2[1] - dir[1] * e2[0];
+    det = e1[0] * pv[0] + e1[1] * pv[1] + e1[2] * pv[2];
+    if (det == 0) return 0;
+
+    u = (s[0] * pv[0] + s[1] * pv[1] + s[2] * pv[2]) / det;
+    if (u < 0 || u > 1) return 0;
+
+    qv[0] = s[1] * e1[2] - s[2] * e1[1];
+    qv[1] = s[2] * e1[0] - s[0] * e1[2];
+    qv[2] = s[0] * e1[1] - s[1] * e1[0];
+    v = (dir[0] * qv[0] + dir[1] * qv[1] + dir[2] * qv[2]) / det;
+    if (v < 0 || u + v > 1) return 0;
+
+    *t = (e2[0] * qv[0] + e2[1] * qv[1] + e2[2] * qv[2]) / det;
+    return *t > 0;
+}
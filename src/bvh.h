@@ -0,0 +1,55 @@
+/*
+ * This file is part of mverse
+ * Copyright (C) 2022  juanvalencia.xyz
+
+ * mverse is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BVH__
+#define __BVH__
+
+#include "obj.h"
+#include "cull.h"
+
+#define BVH_BINS 16             /* SAH candidate planes of a node */
+#define BVH_LEAF_SIZE 4         /* items a node keeps without trying to split */
+#define BVH_LEAF_MAX 16         /* items a node keeps when splitting doesn't pay */
+#define BVH_THREAD_MIN 65536    /* items below which one thread builds the tree */
+
+/*
+ * Box holding items[first] to items[first + count - 1]. An interior node
+ * has its children at left and left + 1, a leaf has left 0
+ */
+typedef struct {
+    float min[3], max[3];
+    unsigned int first, count, left;
+} BvhNode;
+
+/*
+ * Bounding volume hierarchy over the meshes of an Obj or over its
+ * triangles, nodes[0] is the root. Triangle items are their first index
+ * divided by 3
+ */
+typedef struct {
+    BvhNode *nodes;
+    unsigned int *items;
+    unsigned int size, itemSize, depth;
+    int triangles;
+} Bvh;
+
+Bvh bvhBuild(const Obj *obj, int triangles, int nThreads);
+void bvhCull(const Bvh *bvh, const Obj *obj, const Frustum *frustum, unsigned char *visible);
+int bvhRay(const Bvh *bvh, const Obj *obj, const float *origin, const float *dir, float *t, unsigned int *index);
+void bvhFree(Bvh *bvh);
+#endif
@@ -0,0 +1,528 @@
+/*
+ * This file is part of mverse
+ * Copyright (C) 2022  juanvalencia.xyz
+
+ * mverse is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+
+/*
+ * Cache file layout, each section starts at the offset stored in the
+ * header and is aligned to its element size:
+ *
+ *   struct CacheHeader
+ *   struct CacheMesh     meshes[meshSize]
+ *   struct CacheMaterial materials[materialSize]
+ *   char                 names[nameSize]       NUL terminated material names
+ *   struct CacheLibrary  libraries[librarySize]
+ *   char                 libraryNames[libraryNameSize]   NUL terminated mtllib names
+ *   Vertex               vertices[vertexSize]
+ *   unsigned int         indices[indexSize]
+ *
+ * The header keeps the size, modification time and a sampled hash of the
+ * obj file it was built from and every library the same for the mtl file
+ * it read, the cache is ignored when any of them differ
+ */
+struct CacheHeader {
+    char magic[8];
+    uint32_t version, byteOrder;
+    uint64_t sourceSize, sourceHash;
+    int64_t sourceSec, sourceNsec;
+    uint64_t meshSize, materialSize, vertexSize, indexSize, nameSize, librarySize, libraryNameSize;
+    uint64_t meshOffset, materialOffset, nameOffset, libraryOffset, libraryNameOffset, vertexOffset, indexOffset;
+};
+
+struct CacheMesh {
+    uint64_t indexOffset;
+    uint32_t indexSize, material;
+    float min[3], max[3], center[3], radius;
+};
+
+struct CacheMaterial {
+    uint32_t nameOffset;
+    float ka[3], kd[3], ks[3];
+    uint32_t illum;
+    float ns;
+};
+
+/*
+ * Key of a mtl file, a size of UINT64_MAX marks one that was missing
+ */
+struct CacheLibrary {
+    uint64_t nameOffset;
+    uint64_t size, hash;
+    int64_t sec, nsec;
+};
+
+static const char cacheMagic[8] = "MVERSE\x1a";
+static const uint32_t cacheByteOrder = 0x01020304;
+
+static char * cachePath(const char *filename);
+static int sourceKey(const char *filename, struct CacheHeader *key);
+static int cacheValid(const char *filename, const struct CacheHeader *header, const struct CacheHeader *key, size_t size);
+static void libraryKey(const char *filename, const char *name, struct CacheLibrary *library);
+static uint64_t hashBytes(uint64_t hash, const void *data, size_t size);
+static uint64_t align(uint64_t offset, uint64_t alignment);
+static int writeAll(int fd, const void *data, size_t size);
+static size_t pageDrop(void *data, size_t size);
+
+/*
+ * Load obj from the cache of filename, return 1 on success and 0 when
+ * there is no up to date cache. The vertices and indices point into the
+ * mapped cache file
+ */
+int
+cacheLoad(const char *filename, Obj *obj)
+{
+    struct CacheHeader key, *header;
+    struct CacheMesh *meshes;
+    struct CacheMaterial *materials;
+    struct stat st;
+    char *path, *data, *names;
+    uint64_t i;
+    int fd;
+
+    if (!strcmp(filename, "-") || sourceKey(filename, &key))
+        return 0;
+
+    path = cachePath(filename);
+    fd = open(path, O_RDONLY);
+    free(path);
+    if (fd == -1)
+        return 0;
+
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(struct CacheHeader)) {
+        close(fd);
+        return 0;
+    }
+
+    /* Private writable mapping, later passes may rewrite the buffers */
+    data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return 0;
+
+    header = (struct CacheHeader *)data;
+    if (!cacheValid(filename, header, &key, st.st_size)) {
+        munmap(data, st.st_size);
+        return 0;
+    }
+
+    meshes = (struct CacheMesh *)(data + header->meshOffset);
+    materials = (struct CacheMaterial *)(data + header->materialOffset);
+    names = data + header->nameOffset;
+
+    memset(obj, 0, sizeof(*obj));
+    obj->vertices = (Vertex *)(data + header->vertexOffset);
+    obj->vertexSize = header->vertexSize;
+    obj->indices = (unsigned int *)(data + header->indexOffset);
+    obj->indexSize = header->indexSize;
+
+    obj->mesh = (Mesh *)calloc(header->meshSize, sizeof(Mesh));
+    obj->material = (Material *)calloc(header->materialSize, sizeof(Material));
+    if (obj->mesh == NULL || obj->material == NULL) {
+        perror("cacheLoad() Error");
+        exit(1);
+    }
+
+    for (i = 0; i < header->meshSize; i++) {
+        obj->mesh[i].material = meshes[i].material;
+        obj->mesh[i].indexOffset = meshes[i].indexOffset;
+        obj->mesh[i].indexSize = meshes[i].indexSize;
+        memcpy(obj->mesh[i].min, meshes[i].min, sizeof(meshes[i].min));
+        memcpy(obj->mesh[i].max, meshes[i].max, sizeof(meshes[i].max));
+        memcpy(obj->mesh[i].center, meshes[i].center, sizeof(meshes[i].center));
+        obj->mesh[i].radius = meshes[i].radius;
+    }
+
+    for (i = 0; i < header->materialSize; i++) {
+        obj->material[i].name = materials[i].nameOffset;
+        memcpy(obj->material[i].ka, materials[i].ka, sizeof(materials[i].ka));
+        memcpy(obj->material[i].kd, materials[i].kd, sizeof(materials[i].kd));
+        memcpy(obj->material[i].ks, materials[i].ks, sizeof(materials[i].ks));
+        obj->material[i].illum = materials[i].illum;
+        obj->material[i].ns = materials[i].ns;
+    }
+
+    obj->size = header->meshSize;
+    obj->materialSize = header->materialSize;
+    obj->names = names;
+    obj->nameSize = header->nameSize;
+    obj->libraries = data + header->libraryNameOffset;
+    obj->librarySize = header->libraryNameSize;
+    obj->cache = data;
+    obj->cacheSize = st.st_size;
+    return 1;
+}
+
+/*
+ * Write the cache of filename, failing to do so only prints a warning
+ */
+void
+cacheStore(const char *filename, Obj obj)
+{
+    struct CacheHeader header;
+    struct CacheMesh *meshes;
+    struct CacheMaterial *materials;
+    struct CacheLibrary *libraries;
+    char *path, *tmpPath;
+    const char *error;
+    unsigned int i, librarySize;
+    int fd;
+
+    if (!strcmp(filename, "-") || sourceKey(filename, &header))
+        return;
+
+    meshes = (struct CacheMesh *)calloc(obj.size, sizeof(struct CacheMesh));
+    materials = (struct CacheMaterial *)calloc(obj.materialSize, sizeof(struct CacheMaterial));
+    for (i = librarySize = 0; i < obj.librarySize; i++)
+        librarySize += !obj.libraries[i];
+    libraries = (struct CacheLibrary *)calloc(librarySize + 1, sizeof(struct CacheLibrary));
+    path = cachePath(filename);
+    tmpPath = (char *)malloc(strlen(path) + 5);
+    if (meshes == NULL || materials == NULL || libraries == NULL || tmpPath == NULL) {
+        perror("cacheStore() Error");
+        exit(1);
+    }
+    sprintf(tmpPath, "%s.tmp", path);
+
+    for (i = 0; i < obj.size; i++) {
+        meshes[i].indexOffset = obj.mesh[i].indexOffset;
+        meshes[i].indexSize = obj.mesh[i].indexSize;
+        meshes[i].material = obj.mesh[i].material;
+        memcpy(meshes[i].min, obj.mesh[i].min, sizeof(meshes[i].min));
+        memcpy(meshes[i].max, obj.mesh[i].max, sizeof(meshes[i].max));
+        memcpy(meshes[i].center, obj.mesh[i].center, sizeof(meshes[i].center));
+        meshes[i].radius = obj.mesh[i].radius;
+    }
+
+    for (i = 0; i < obj.materialSize; i++) {
+        materials[i].nameOffset = obj.material[i].name;
+        memcpy(materials[i].ka, obj.material[i].ka, sizeof(materials[i].ka));
+        memcpy(materials[i].kd, obj.material[i].kd, sizeof(materials[i].kd));
+        memcpy(materials[i].ks, obj.material[i].ks, sizeof(materials[i].ks));
+        materials[i].illum = obj.material[i].illum;
+        materials[i].ns = obj.material[i].ns;
+    }
+
+    for (i = librarySize = 0; i < obj.librarySize; i += strlen(obj.libraries + i) + 1) {
+        libraries[librarySize].nameOffset = i;
+        libraryKey(filename, obj.libraries + i, libraries + librarySize++);
+    }
+
+    memcpy(header.magic, cacheMagic, sizeof(header.magic));
+    header.version = CACHE_VERSION;
+    header.byteOrder = cacheByteOrder;
+    header.meshSize = obj.size;
+    header.materialSize = obj.materialSize;
+    header.vertexSize = obj.vertexSize;
+    header.indexSize = obj.indexSize;
+    header.nameSize = obj.nameSize;
+    header.librarySize = librarySize;
+    header.libraryNameSize = obj.librarySize;
+    header.meshOffset = align(sizeof(header), sizeof(uint64_t));
+    header.materialOffset = header.meshOffset + obj.size * sizeof(struct CacheMesh);
+    header.nameOffset = header.materialOffset + obj.materialSize * sizeof(struct CacheMaterial);
+    header.libraryOffset = align(header.nameOffset + obj.nameSize, sizeof(uint64_t));
+    header.libraryNameOffset = header.libraryOffset + librarySize * sizeof(struct CacheLibrary);
+    header.vertexOffset = align(header.libraryNameOffset + obj.librarySize, sizeof(Vertex));
+    header.indexOffset = header.vertexOffset + header.vertexSize * sizeof(Vertex);
+
+    error = NULL;
+    if ((fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        error = strerror(errno);
+    } else {
+        if (writeAll(fd, &header, sizeof(header))
+            || lseek(fd, header.meshOffset, SEEK_SET) == -1
+            || writeAll(fd, meshes, obj.size * sizeof(struct CacheMesh))
+            || writeAll(fd, materials, obj.materialSize * sizeof(struct CacheMaterial))
+            || writeAll(fd, obj.names, obj.nameSize)
+            || lseek(fd, header.libraryOffset, SEEK_SET) == -1
+            || writeAll(fd, libraries, librarySize * sizeof(struct CacheLibrary))
+            || writeAll(fd, obj.libraries, obj.librarySize))
+            error = strerror(errno);
+
+        if (!error && (lseek(fd, header.vertexOffset, SEEK_SET) == -1
+            || writeAll(fd, obj.vertices, obj.vertexSize * sizeof(Vertex))
+            || writeAll(fd, obj.indices, obj.indexSize * sizeof(unsigned int))))
+            error = strerror(errno);
+
+        if (close(fd) && !error)
+            error = strerror(errno);
+        if (!error && rename(tmpPath, path))
+            error = strerror(errno);
+        if (error)
+            unlink(tmpPath);
+    }
+
+    if (error)
+        fprintf(stderr, "cacheStore() Warning: %s: %s\n", path, error);
+
+    free(meshes);
+    free(materials);
+    free(libraries);
+    free(path);
+    free(tmpPath);
+}
+
+/*
+ * Give the memory of the vertices and indices of obj, which point into its
+ * cache mapping, back to the system. Pages still holding the file are read
+ * from it again when touched, rewritten ones go back to what the file
+ * holds. Return the bytes dropped
+ */
+size_t
+cacheRelease(Obj *obj)
+{
+    if (obj->cache == NULL) return 0;
+    return pageDrop(obj->vertices, obj->vertexSize * sizeof(Vertex))
+         + pageDrop(obj->indices, obj->indexSize * sizeof(unsigned int));
+}
+
+/*
+ * The cache lives next to the obj file, or in $MVERSE_CACHE_DIR named
+ * after a hash of the obj file path when it is set
+ */
+char *
+cachePath(const char *filename)
+{
+    char *path, *realPath;
+    const char *dir;
+    uint64_t hash;
+
+    dir = getenv("MVERSE_CACHE_DIR");
+    if (dir && *dir) {
+        realPath = realpath(filename, NULL);
+        hash = hashBytes(UINT64_C(14695981039346656037),
+                         realPath ? realPath : filename,
+                         strlen(realPath ? realPath : filename));
+        free(realPath);
+
+        path = (char *)malloc(strlen(dir) + 18 + sizeof(CACHE_SUFFIX));
+        if (path) sprintf(path, "%s/%016llx" CACHE_SUFFIX, dir, (unsigned long long)hash);
+    } else {
+        path = (char *)malloc(strlen(filename) + sizeof(CACHE_SUFFIX));
+        if (path) sprintf(path, "%s" CACHE_SUFFIX, filename);
+    }
+
+    if (path == NULL) {
+        perror("cachePath() Error");
+        exit(1);
+    }
+    return path;
+}
+
+/*
+ * Fill the source fields of key from filename. The content hash covers
+ * the whole file when it is small and CACHE_SAMPLES evenly spaced blocks
+ * otherwise, so checking a cache stays cheap for huge models
+ */
+int
+sourceKey(const char *filename, struct CacheHeader *key)
+{
+    struct stat st;
+    char block[CACHE_SAMPLE_SIZE];
+    uint64_t hash;
+    off_t offset, span;
+    ssize_t n;
+    int fd, i, samples;
+
+    if ((fd = open(filename, O_RDONLY)) == -1)
+        return -1;
+
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return -1;
+    }
+
+    hash = hashBytes(UINT64_C(14695981039346656037), &st.st_size, sizeof(st.st_size));
+    span = (st.st_size > CACHE_SAMPLE_SIZE) ? st.st_size - CACHE_SAMPLE_SIZE : 0;
+    samples = (st.st_size > (off_t)CACHE_SAMPLES * CACHE_SAMPLE_SIZE)
+              ? CACHE_SAMPLES
+              : (st.st_size + CACHE_SAMPLE_SIZE - 1) / CACHE_SAMPLE_SIZE;
+
+    for (i = 0; i < samples; i++) {
+        offset = (samples == CACHE_SAMPLES)
+                 ? span / (CACHE_SAMPLES - 1) * i
+                 : (off_t)i * CACHE_SAMPLE_SIZE;
+        if ((n = pread(fd, block, sizeof(block), offset)) < 0) {
+            close(fd);
+            return -1;
+        }
+        hash = hashBytes(hash, block, n);
+    }
+    close(fd);
+
+    key->sourceSize = st.st_size;
+    key->sourceHash = hash;
+    key->sourceSec = st.st_mtim.tv_sec;
+    key->sourceNsec = st.st_mtim.tv_nsec;
+    return 0;
+}
+
+/*
+ * Check that header belongs to the source described by key, that the mtl
+ * files filename read did not change and that every section fits in the
+ * size bytes of the mapping
+ */
+int
+cacheValid(const char *filename, const struct CacheHeader *header, const struct CacheHeader *key, size_t size)
+{
+    const struct CacheMesh *meshes;
+    const struct CacheMaterial *materials;
+    const struct CacheLibrary *libraries;
+    struct CacheLibrary library;
+    const char *libraryNames;
+    uint64_t i;
+
+    if (memcmp(header->magic, cacheMagic, sizeof(header->magic))
+        || header->version != CACHE_VERSION
+        || header->byteOrder != cacheByteOrder
+        || header->sourceSize != key->sourceSize
+        || header->sourceHash != key->sourceHash
+        || header->sourceSec != key->sourceSec
+        || header->sourceNsec != key->sourceNsec)
+        return 0;
+
+    if (header->meshOffset % sizeof(uint64_t) || header->vertexOffset % sizeof(Vertex)
+        || header->indexOffset % sizeof(unsigned int)
+        || header->materialOffset % sizeof(uint32_t)
+        || header->libraryOffset % sizeof(uint64_t)
+        || header->meshOffset + header->meshSize * sizeof(struct CacheMesh) > size
+        || header->materialOffset + header->materialSize * sizeof(struct CacheMaterial) > size
+        || header->nameOffset + header->nameSize > size
+        || header->libraryOffset + header->librarySize * sizeof(struct CacheLibrary) > size
+        || header->libraryNameOffset + header->libraryNameSize > size
+        || header->vertexOffset + header->vertexSize * sizeof(Vertex) > size
+        || header->indexOffset + header->indexSize * sizeof(unsigned int) > size
+        || (header->nameSize && ((const char *)header)[header->nameOffset + header->nameSize - 1])
+        || (header->libraryNameSize && ((const char *)header)[header->libraryNameOffset + header->libraryNameSize - 1]))
+        return 0;
+
+    meshes = (const struct CacheMesh *)((const char *)header + header->meshOffset);
+    for (i = 0; i < header->meshSize; i++) {
+        if (meshes[i].indexOffset + meshes[i].indexSize > header->indexSize
+            || meshes[i].material >= header->materialSize)
+            return 0;
+    }
+
+    materials = (const struct CacheMaterial *)((const char *)header + header->materialOffset);
+    for (i = 0; i < header->materialSize; i++) {
+        if (materials[i].nameOffset >= header->nameSize)
+            return 0;
+    }
+
+    libraries = (const struct CacheLibrary *)((const char *)header + header->libraryOffset);
+    libraryNames = (const char *)header + header->libraryNameOffset;
+    for (i = 0; i < header->librarySize; i++) {
+        if (libraries[i].nameOffset >= header->libraryNameSize)
+            return 0;
+        libraryKey(filename, libraryNames + libraries[i].nameOffset, &library);
+        if (library.size != libraries[i].size || library.hash != libraries[i].hash
+            || library.sec != libraries[i].sec || library.nsec != libraries[i].nsec)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Fill the key fields of library from the mtl file name of filename
+ */
+void
+libraryKey(const char *filename, const char *name, struct CacheLibrary *library)
+{
+    struct CacheHeader key;
+    char *path;
+
+    path = objMtlPath(filename, name, strlen(name));
+    if (sourceKey(path, &key)) {
+        library->size = UINT64_MAX;
+        library->hash = 0;
+        library->sec = library->nsec = 0;
+    } else {
+        library->size = key.sourceSize;
+        library->hash = key.sourceHash;
+        library->sec = key.sourceSec;
+        library->nsec = key.sourceNsec;
+    }
+    free(path);
+}
+
+/*
+ * FNV-1a
+ */
+uint64_t
+hashBytes(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *ptr = (const unsigned char *)data;
+    while (size--) {
+        hash ^= *ptr++;
+        hash *= UINT64_C(1099511628211);
+    }
+    return hash;
+}
+
+uint64_t
+align(uint64_t offset, uint64_t alignment)
+{
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+int
+writeAll(int fd, const void *data, size_t size)
+{
+    const char *ptr = (const char *)data;
+    ssize_t n;
+
+    while (size > 0) {
+        if ((n = write(fd, ptr, size)) < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        ptr += n;
+        size -= n;
+    }
+    return 0;
+}
+
+/*
+ * Drop the whole pages inside data, the ones it shares are kept
+ */
+size_t
+pageDrop(void *data, size_t size)
+{
+    uintptr_t page, first, last;
+
+    page = sysconf(_SC_PAGESIZE);
+    first = ((uintptr_t)data + page - 1) / page * page;
+    last = ((uintptr_t)data + size) / page * page;
+    if (data == NULL || last <= first || madvise((void *)first, last - first, MADV_DONTNEED))
+        return 0;
+    return last - first;
+}
@@ -0,0 +1,32 @@
+/*
+ * This file is part of mverse
+ * Copyright (C) 2022  juanvalencia.xyz
+
+ * mverse is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CACHE__
+#define __CACHE__
+
+#include "obj.h"
+
+#define CACHE_VERSION 4
+#define CACHE_SUFFIX ".mvcache"
+#define CACHE_SAMPLES 64
+#define CACHE_SAMPLE_SIZE 4096
+
+int cacheLoad(const char *filename, Obj *obj);
+void cacheStore(const char *filename, Obj obj);
+size_t cacheRelease(Obj *obj);
+#endif
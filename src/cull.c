@@ -0,0 +1,136 @@
+/*
+ * This file is part of mverse
+ * Copyright (C) 2022  juanvalencia.xyz
+
+ * mverse is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+
+#include "cull.h"
+
+/*
+ * Frustum in the space of the model, so bounds computed from the vertices
+ * are tested as they are. eye is the camera position in world space
+ */
+Frustum
+cullFrustum(Mat4 proj, Mat4 view, Mat4 model, Vec3 eye)
+{
+    Frustum f;
+    Mat4 clip;
+    float length, sign;
+    int i, j;
+
+    /* Gribb and Hartmann: each plane is the last row plus or minus another */
+    clip = linearMat4Muln(3, proj, view, model);
+    for (i = 0; i < 6; i++) {
+        sign = (i % 2) ? -1 : 1;
+        for (j = 0; j < 4; j++)
+            f.plane[i][j] = clip.matrix[3][j] + sign * clip.matrix[i / 2][j];
+
+        length = sqrtf(f.plane[i][0] * f.plane[i][0] + f.plane[i][1] * f.plane[i][1]
+                       + f.plane[i][2] * f.plane[i][2]);
+        if (length > 0)
+            for (j = 0; j < 4; j++) f.plane[i][j] /= length;
+    }
+
+    f.eye = cullModelPoint(model, eye);
+    f.clip = clip;
+    return f;
+}
+
+/*
+ * Return 1 when the sphere is completely outside the frustum
+ */
+int
+cullSphere(const Frustum *frustum, const float *center, float radius)
+{
+    const float *p;
+    int i;
+
+    for (i = 0; i < 6; i++) {
+        p = frustum->plane[i];
+        if (p[0] * center[0] + p[1] * center[1] + p[2] * center[2] + p[3] < -radius)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Return 1 when the box is completely outside one of the planes, tested
+ * with its corner furthest along the plane normal
+ */
+int
+cullBox(const Frustum *frustum, const float *min, const float *max)
+{
+    const float *p;
+    int i;
+
+    for (i = 0; i < 6; i++) {
+        p = frustum->plane[i];
+        if (p[0] * (p[0] > 0 ? max[0] : min[0]) + p[1] * (p[1] > 0 ? max[1] : min[1])
+            + p[2] * (p[2] > 0 ? max[2] : min[2]) + p[3] < 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Return 1 when every triangle in bounds faces away from the eye
+ */
+int
+cullCone(const Frustum *frustum, const Bounds *bounds)
+{
+    float d[3], length;
+    int i;
+
+    for (i = 0; i < 3; i++)
+        d[i] = bounds->center[i] - frustum->eye.vector[i];
+    length = sqrtf(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+
+    return d[0] * bounds->axis[0] + d[1] * bounds->axis[1] + d[2] * bounds->axis[2]
+           >= bounds->cutoff * length + bounds->radius;
+}
+
+/*
+ * Take a world space point to the space of the affine model matrix
+ */
+Vec3
+cullModelPoint(Mat4 model, Vec3 point)
+{
+    float (*m)[4] = model.matrix;
+    float b[3], det;
+    Vec3 out;
+    int i;
+
+    for (i = 0; i < 3; i++)
+        b[i] = point.vector[i] - m[i][3];
+
+    /* Cramer's rule on the upper 3x3 block */
+    det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+        - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+        + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    if (det == 0) return point;
+
+    out.vector[0] = (b[0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+                   - m[0][1] * (b[1] * m[2][2] - m[1][2] * b[2])
+                   + m[0][2] * (b[1] * m[2][1] - m[1][1] * b[2])) / det;
+    out.vector[1] = (m[0][0] * (b[1] * m[2][2] - m[1][2] * b[2])
+                   - b[0] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+                   + m[0][2] * (m[1][0] * b[2] - b[1] * m[2][0])) / det;
+    out.vector[2] = (m[0][0] * (m[1][1] * b[2] - b[1] * m[2][1])
+                   - m[0][1] * (m[1][0] * b[2] - b[1] * m[2][0])
+                   + b[0] * (m[1][0] * m[2][1] - m[1][1] * m[2][0])) / det;
+    return out;
+}
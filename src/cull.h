@@ -0,0 +1,41 @@
+/*
+ * This file is part of mverse
+ * Copyright (C) 2022  juanvalencia.xyz
+
+ * mverse is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CULL__
+#define __CULL__
+
+#include "linear.h"
+#include "obj.h"
+
+/*
+ * The 6 planes bounding the view, a point p is inside when
+ * plane[0] * p.x + plane[1] * p.y + plane[2] * p.z + plane[3] >= 0 for all.
+ * clip takes the model to clip space
+ */
+typedef struct {
+    float plane[6][4];
+    Vec3 eye;
+    Mat4 clip;
+} Frustum;
+
+Frustum cullFrustum(Mat4 proj, Mat4 view, Mat4 model, Vec3 eye);
+int cullSphere(const Frustum *frustum, const float *center, float radius);
+int cullBox(const Frustum *frustum, const float *min, const float *max);
+int cullCone(const Frustum *frustum, const Bounds *bounds);
+Vec3 cullModelPoint(Mat4 model, Vec3 point);
+#endif
@@ -22,8 +22,10 @@
 #include <string.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <limits.h>
 
 #include <getopt.h>
+#include <pthread.h>
 #include <math.h>
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
@@ -35,6 +37,12 @@
 #include "linear.h"
 #include "shader.h"
 #include "obj.h"
+#include "cache.h"
+#include "meshopt.h"
+#include "cull.h"
+#include "bvh.h"
+#include "occlude.h"
+#include "upload.h"
 
 struct Camera {
     Vec3 position;
@@ -42,6 +50,57 @@ struct Camera {
     Vec3 up;
 };
 
+/*
+ * Uniform locations of the program, resolved once after linking
+ */
+struct Uniforms {
+    int materials;
+};
+
+/*
+ * Range of indices drawn with one call, base is subtracted from the 16 bit
+ * ones and added back by the draw. source is the mesh or meshlet it comes
+ * from and level its detail level
+ */
+struct Draw {
+    const unsigned int *indices;
+    unsigned int offset, count, base, source, level;
+    int wide;
+};
+
+/*
+ * std140 layout of the Camera and Light uniform blocks, the matrices are
+ * declared row_major in the shaders so Mat4 goes in as it is
+ */
+struct CameraBlock {
+    Mat4 model, view, proj, rotNormals;
+    float viewPos[4];
+};
+
+/*
+ * Model loaded on a thread of its own while the window shows empty frames.
+ * stage names what the thread is doing, obj, its draws and the
+ * hierarchies belong to the render thread once done is set
+ */
+struct Load {
+    const char *path, *stage;
+    Obj obj;
+    Bvh meshBvh, triangleBvh;
+    const unsigned int **sources;   /* indices of each draw, from drawSetUp() */
+    size_t indexBytes;
+    int packed;
+    int done;
+    pthread_t thread;
+    pthread_mutex_t lock;
+};
+
+struct LightBlock {
+    float direction[4];
+    float ambient[4];
+    float diffuse[4];
+    float specular[4];
+};
+
 static void loadCLI(int argc, char *argv[], char **vertexPath, char **fragmentPath);
 static void initOpengl(void);
 static void initGlfw(void);
@@ -50,23 +109,96 @@ static void glfw_size_callback(GLFWwindow *window, int width, int height);
 static void processInput(GLFWwindow *window);
 static Mat4 processCameraInput(GLFWwindow *window, struct Camera *cameraObj, float deltaTime);
 static unsigned int loadTexture(char const *path);
-static void meshSetUp(Mesh *mesh);
-static void meshDraw(unsigned int shader, Mesh mesh);
-static void objSetUp(Obj obj);
-static void objDraw(unsigned int shader, Obj obj);
+static void objSetUp(Obj *obj, Upload *upload, const struct Load *load);
+static void objRelease(Obj *obj);
+static void objTearDown(Obj *obj);
+static void vertexSetUp(Obj *obj, int packed);
+static const unsigned int ** drawSetUp(Obj *obj, size_t *indexBytes);
+static unsigned int meshDraws(const unsigned int *indices, Mesh mesh, struct Draw **draws, unsigned int size, unsigned int *capacity);
+static struct Draw * drawAdd(struct Draw *draws, unsigned int size, unsigned int *capacity, struct Draw draw);
+static void materialSetUp(Obj *obj);
+static void objDraw(Obj obj);
+static unsigned int objCull(Obj *obj, const Frustum *frustum, const Bvh *bvh, Occlusion *occlusion, unsigned int *culled, unsigned int *occluded);
+static void objSelectLod(Obj *obj, const Frustum *frustum, float pixels);
+static void objPick(const Obj *obj, const Bvh *bvh, GLFWwindow *window, Mat4 proj, Mat4 view, Mat4 world, Vec3 eye);
+static void drawListInit(DrawList *list, unsigned int size);
+static struct Uniforms uniformsGet(unsigned int shader);
+static unsigned int blockCreate(unsigned int binding, const void *data, size_t size);
+static void blockUpdate(unsigned int ubo, void *last, const void *data, size_t size);
+static void * objLoad(void *load);
+static void loadStage(struct Load *load, const char *stage);
 static void usage(int status);
 
 static float cameraSpeed = 2.0;
+static int loadThreads = 0;
+static int useCache = 1;
+static int optimize = 0;
+static int quantize = 0;
+static int splitIndices = 0;
+static int useMeshlets = 0;
+static int useLods = 0;
+static int useBvh = 0;
+static int useOcclusion = 0;
+static int keepHost = 0;
+static int mergeMeshes = 0;
+static size_t uploadBudget = UPLOAD_BUDGET;
 
 void
 loadCLI(int argc, char *argv[], char **vertexPath, char **fragmentPath)
 {
+    char *end;
+    long budget, threads;
     int opt;
-    while ((opt = getopt(argc, argv, "hv:f:")) != -1) {
+    while ((opt = getopt(argc, argv, "hCMOqsmlbokj:u:v:f:")) != -1) {
         switch (opt) {
             case 'h':
                 usage(0);
                 break;
+            case 'C':
+                useCache = 0;
+                break;
+            case 'M':
+                mergeMeshes = 1;
+                break;
+            case 'O':
+                optimize = 1;
+                break;
+            case 'q':
+                quantize = 1;
+                break;
+            case 's':
+                splitIndices = 1;
+                break;
+            case 'm':
+                useMeshlets = 1;
+                break;
+            case 'l':
+                useLods = 1;
+                break;
+            case 'b':
+                useBvh = 1;
+                break;
+            case 'o':
+                useOcclusion = 1;
+                break;
+            case 'k':
+                keepHost = 1;
+                break;
+            case 'j':
+                errno = 0;
+                threads = strtol(optarg, &end, 10);
+                if (errno || end == optarg || *end || threads < 1 || threads > MAX_THREADS)
+                    usage(2);
+                loadThreads = threads;
+                break;
+            case 'u':
+                errno = 0;
+                budget = strtol(optarg, &end, 10);
+                if (errno || end == optarg || *end || budget < 1
+                    || (unsigned long)budget > (size_t)-1 >> 20)
+                    usage(2);
+                uploadBudget = budget;
+                break;
             case 'v':
                 *vertexPath = optarg;
                 break;
@@ -255,65 +387,609 @@ loadTexture(char const *path)
 }
 
 
+/*
+ * Create the GL objects of obj, sized from what objLoad() left in load,
+ * and leave in upload where the data of their buffers comes from, written
+ * by uploadFrame() -u megabytes a frame
+ */
 void
-meshSetUp(Mesh *mesh)
+objSetUp(Obj *obj, Upload *upload, const struct Load *load)
 {
-    glGenVertexArrays(1, &(mesh->VAO));
-    glGenBuffers(1, &(mesh->VBO));
-    glGenBuffers(1, &(mesh->EBO));
+    glGenVertexArrays(1, &(obj->VAO));
+    glGenBuffers(1, &(obj->VBO));
+    glGenBuffers(1, &(obj->EBO));
 
-    glBindVertexArray(mesh->VAO);
+    glBindVertexArray(obj->VAO);
 
-    glBindBuffer(GL_ARRAY_BUFFER, mesh->VBO);
-    glBufferData(GL_ARRAY_BUFFER, mesh->vertexSize * sizeof(Vertex), mesh->vertices, GL_STATIC_DRAW);
+    vertexSetUp(obj, load->packed);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, obj->EBO);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, load->indexBytes, NULL, GL_STATIC_DRAW);
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->EBO);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, mesh->indexSize * sizeof(int), mesh->indices, GL_STATIC_DRAW);
+    glBindVertexArray(0);
 
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE,  sizeof(Vertex), (void *)0);
+    materialSetUp(obj);
+    *upload = uploadCreate(obj, load->packed, load->sources, uploadBudget << 20);
+}
 
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void *)offsetof(Vertex, normal));
+/*
+ * Drop the vertices and indices in memory once they are all in the GL
+ * buffers. Those still as the cache file holds them, not reordered by -O,
+ * -M or -m, are read back from it when picking or occlusion touch them, the
+ * others are only freed when neither needs them
+ */
+void
+objRelease(Obj *obj)
+{
+    size_t bytes;
+
+    bytes = obj->vertexSize * sizeof(Vertex) + obj->indexSize * sizeof(unsigned int);
+    if (obj->cache && !optimize && !mergeMeshes && !useMeshlets) {
+        bytes = cacheRelease(obj);
+        fprintf(stderr, "objRelease(): %.1f MB dropped, read back from the cache when needed\n", bytes / 1e6);
+    } else if (!useBvh && !useOcclusion) {
+        if (obj->cache) {
+            cacheRelease(obj);
+        } else {
+            free(obj->vertices);
+            free(obj->indices);
+        }
+        obj->vertices = NULL;
+        obj->indices = NULL;
+        fprintf(stderr, "objRelease(): %.1f MB freed\n", bytes / 1e6);
+    } else {
+        fprintf(stderr, "objRelease(): %.1f MB kept for picking and occlusion\n", bytes / 1e6);
+    }
 
-    glEnableVertexAttribArray(2);
-    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void *)offsetof(Vertex, texCoords));
+    free(obj->lodIndices);
+    obj->lodIndices = NULL;
+}
 
-    glBindVertexArray(0);
+/*
+ * Delete the GL objects of obj and free the rest
+ */
+void
+objTearDown(Obj *obj)
+{
+    glDeleteVertexArrays(1, &(obj->VAO));
+    glDeleteBuffers(1, &(obj->VBO));
+    glDeleteBuffers(1, &(obj->EBO));
+    glDeleteTextures(1, &(obj->materialTexture));
+    glDeleteBuffers(1, &(obj->materialTBO));
+    objDestroy(obj);
+}
+
+/*
+ * Fill the draw lists, leave the size of the EBO in indexBytes and return
+ * where the indices of each draw come from. Meshes whose vertices span at most
+ * 65536 entries go in a 16 bit section at the start of the EBO, relative
+ * to their first vertex. With -s the other meshes are cut in runs of
+ * triangles that fit too, the rest keeps 32 bit indices after them.
+ * When the Obj has meshlets they are drawn instead of the meshes, when it
+ * has detail levels every level of a mesh gets its draws
+ */
+const unsigned int **
+drawSetUp(Obj *obj, size_t *indexBytes)
+{
+    struct Draw *draws = NULL;
+    unsigned int i, k, size, capacity, shortSize, first, level;
+    const unsigned int **sources;
+    size_t offset;
+    Mesh range;
+
+    for (i = size = capacity = 0; i < (obj->meshlet ? obj->meshletSize : obj->size); i++) {
+        for (level = 0; level < (obj->lod ? OBJ_LOD_LEVELS : 1); level++) {
+            if (obj->meshlet) {
+                range.indexOffset = obj->meshlet[i].indexOffset;
+                range.indexSize = obj->meshlet[i].indexSize;
+            } else if (obj->lod) {
+                range.indexOffset = obj->lod[i].indexOffset[level];
+                range.indexSize = obj->lod[i].indexSize[level];
+            } else {
+                range = obj->mesh[i];
+            }
+
+            first = size;
+            size = meshDraws(level ? obj->lodIndices : obj->indices, range, &draws, size, &capacity);
+            for (; first < size; first++) {
+                draws[first].source = i;
+                draws[first].level = level;
+            }
+        }
+    }
+
+    for (i = shortSize = 0; i < size; i++)
+        if (!draws[i].wide) shortSize += draws[i].count;
+
+    /* The 32 bit section starts 4 byte aligned */
+    shortSize = (shortSize + 1) & ~1u;
+    sources = (const unsigned int **)malloc((size + 1) * sizeof(unsigned int *));
+    obj->drawSource = (unsigned int *)malloc((size + 1) * sizeof(unsigned int));
+    obj->drawLevel = (unsigned int *)malloc((size + 1) * sizeof(unsigned int));
+    obj->meshVisible = (unsigned char *)malloc(obj->size + 1);
+    if (sources == NULL || obj->drawSource == NULL || obj->drawLevel == NULL || obj->meshVisible == NULL) {
+        perror("drawSetUp() Error");
+        exit(1);
+    }
+    drawListInit(&obj->draws, size);
+    drawListInit(&obj->visible, size);
+
+    obj->draws.size = size;
+    for (i = k = 0, offset = 0; i < size; i++) {
+        if (draws[i].wide) continue;
+        obj->drawSource[k] = draws[i].source;
+        obj->drawLevel[k] = draws[i].level;
+        obj->draws.count[k] = draws[i].count;
+        obj->draws.base[k] = draws[i].base;
+        obj->draws.offset[k] = (void *)offset;
+        sources[k++] = draws[i].indices + draws[i].offset;
+        offset += draws[i].count * sizeof(unsigned short);
+    }
+    obj->draws.shortSize = k;
+    offset = shortSize * sizeof(unsigned short);
+    for (i = 0; i < size; i++) {
+        if (!draws[i].wide) continue;
+        obj->drawSource[k] = draws[i].source;
+        obj->drawLevel[k] = draws[i].level;
+        obj->draws.count[k] = draws[i].count;
+        obj->draws.base[k] = 0;
+        obj->draws.offset[k] = (void *)offset;
+        sources[k++] = draws[i].indices + draws[i].offset;
+        offset += draws[i].count * sizeof(unsigned int);
+    }
+    *indexBytes = offset;
+
+    free(draws);
+    return sources;
+}
+
+/*
+ * Append the draws of the mesh range of indices to draws and return their
+ * new size
+ */
+unsigned int
+meshDraws(const unsigned int *indices, Mesh mesh, struct Draw **draws, unsigned int size, unsigned int *capacity)
+{
+    struct Draw draw;
+    unsigned int i, j, v, first, lo, hi, triLo, triHi, start;
+
+    lo = UINT_MAX;
+    hi = 0;
+    for (i = 0; i < mesh.indexSize; i++) {
+        v = indices[mesh.indexOffset + i];
+        if (v < lo) lo = v;
+        if (v > hi) hi = v;
+    }
+
+    draw.indices = indices;
+    draw.offset = mesh.indexOffset;
+    draw.count = mesh.indexSize;
+    draw.base = lo;
+    draw.wide = 0;
+    if (mesh.indexSize == 0) return size;
+    if (hi - lo <= USHRT_MAX || !splitIndices) {
+        draw.wide = (hi - lo > USHRT_MAX);
+        *draws = drawAdd(*draws, size, capacity, draw);
+        return size + 1;
+    }
+
+    first = size;
+    start = mesh.indexOffset;
+    lo = UINT_MAX;
+    hi = 0;
+    for (i = mesh.indexOffset; i < mesh.indexOffset + mesh.indexSize; i += 3) {
+        triLo = UINT_MAX;
+        triHi = 0;
+        for (j = 0; j < 3; j++) {
+            v = indices[i + j];
+            if (v < triLo) triLo = v;
+            if (v > triHi) triHi = v;
+        }
+
+        /* A triangle that doesn't fit by itself keeps the whole mesh 32 bit */
+        if (triHi - triLo > USHRT_MAX) {
+            draw.offset = mesh.indexOffset;
+            draw.count = mesh.indexSize;
+            draw.base = 0;
+            draw.wide = 1;
+            *draws = drawAdd(*draws, first, capacity, draw);
+            return first + 1;
+        }
+
+        if ((triHi > hi ? triHi : hi) - (triLo < lo ? triLo : lo) > USHRT_MAX) {
+            draw.offset = start;
+            draw.count = i - start;
+            draw.base = lo;
+            *draws = drawAdd(*draws, size++, capacity, draw);
+            start = i;
+            lo = UINT_MAX;
+            hi = 0;
+        }
+        if (triLo < lo) lo = triLo;
+        if (triHi > hi) hi = triHi;
+    }
+
+    draw.offset = start;
+    draw.count = mesh.indexOffset + mesh.indexSize - start;
+    draw.base = lo;
+    *draws = drawAdd(*draws, size++, capacity, draw);
+    return size;
 }
 
 void
-meshDraw(unsigned int shader, Mesh mesh)
+drawListInit(DrawList *list, unsigned int size)
 {
-    glBindVertexArray(mesh.VAO);
-    glDrawElements(GL_TRIANGLES, mesh.indexSize, GL_UNSIGNED_INT, 0);
-    glBindVertexArray(0);
+    list->count = (int *)malloc((size + 1) * sizeof(int));
+    list->base = (int *)malloc((size + 1) * sizeof(int));
+    list->offset = (void **)malloc((size + 1) * sizeof(void *));
+    if (list->count == NULL || list->base == NULL || list->offset == NULL) {
+        perror("drawListInit() Error");
+        exit(1);
+    }
+    list->size = list->shortSize = 0;
+}
+
+struct Draw *
+drawAdd(struct Draw *draws, unsigned int size, unsigned int *capacity, struct Draw draw)
+{
+    if (size == *capacity) {
+        *capacity = *capacity ? 2 * *capacity : 16;
+        draws = (struct Draw *)realloc(draws, *capacity * sizeof(struct Draw));
+        if (draws == NULL) {
+            perror("drawAdd() Error");
+            exit(1);
+        }
+    }
+    draws[size] = draw;
+    return draws;
 }
 
+/*
+ * Size the VBO and describe it to the bound VAO, as PackedVertex when
+ * packed is set
+ */
 void
-objSetUp(Obj obj)
+vertexSetUp(Obj *obj, int packed)
 {
     int i;
-    for (i = 0;  i < obj.size; i++)
-        meshSetUp(obj.mesh + i);
+
+    glBindBuffer(GL_ARRAY_BUFFER, obj->VBO);
+
+    if (packed) {
+        glBufferData(GL_ARRAY_BUFFER, obj->vertexSize * sizeof(PackedVertex), NULL, GL_STATIC_DRAW);
+        glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(PackedVertex), (void *)offsetof(PackedVertex, position));
+        glVertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, GL_FALSE, sizeof(PackedVertex), (void *)offsetof(PackedVertex, normal));
+        glVertexAttribPointer(2, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(PackedVertex), (void *)offsetof(PackedVertex, texCoords));
+        glVertexAttribIPointer(3, 1, GL_UNSIGNED_SHORT, sizeof(PackedVertex), (void *)offsetof(PackedVertex, material));
+    } else {
+        glBufferData(GL_ARRAY_BUFFER, obj->vertexSize * sizeof(Vertex), NULL, GL_STATIC_DRAW);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *)offsetof(Vertex, position));
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *)offsetof(Vertex, normal));
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *)offsetof(Vertex, texCoords));
+        glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, sizeof(Vertex), (void *)offsetof(Vertex, material));
+    }
+
+    for (i = 0; i < 4; i++)
+        glEnableVertexAttribArray(i);
 }
 
+/*
+ * Pack the material table in a buffer texture the shaders index with the
+ * vertex material, every material takes MATERIAL_TEXELS texels:
+ * (ka, Ns), (kd, illum), (ks, 0)
+ */
 void
-objDraw(unsigned int shader, Obj obj)
+materialSetUp(Obj *obj)
 {
+    float *texels, *t;
+    unsigned int i;
+
+    texels = (float *)calloc(obj->materialSize * MATERIAL_TEXELS * 4, sizeof(float));
+    if (texels == NULL) {
+        perror("materialSetUp() Error");
+        exit(1);
+    }
+
+    for (i = 0; i < obj->materialSize; i++) {
+        t = texels + i * MATERIAL_TEXELS * 4;
+        memcpy(t,     obj->material[i].ka, sizeof(obj->material[i].ka));
+        memcpy(t + 4, obj->material[i].kd, sizeof(obj->material[i].kd));
+        memcpy(t + 8, obj->material[i].ks, sizeof(obj->material[i].ks));
+        t[3] = obj->material[i].ns;
+        t[7] = obj->material[i].illum;
+    }
+
+    glGenBuffers(1, &(obj->materialTBO));
+    glBindBuffer(GL_TEXTURE_BUFFER, obj->materialTBO);
+    glBufferData(GL_TEXTURE_BUFFER, obj->materialSize * MATERIAL_TEXELS * 4 * sizeof(float), texels, GL_STATIC_DRAW);
+
+    glGenTextures(1, &(obj->materialTexture));
+    glBindTexture(GL_TEXTURE_BUFFER, obj->materialTexture);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, obj->materialTBO);
+
+    glBindTexture(GL_TEXTURE_BUFFER, 0);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    free(texels);
+}
+
+/*
+ * Draw the meshes objCull() kept with one call per index size, the shader
+ * reads the material of each vertex from the material buffer bound to
+ * texture unit 0
+ */
+void
+objDraw(Obj obj)
+{
+    DrawList list = obj.visible;
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_BUFFER, obj.materialTexture);
+
+    glBindVertexArray(obj.VAO);
+    if (list.shortSize)
+        glMultiDrawElementsBaseVertex(GL_TRIANGLES, list.count, GL_UNSIGNED_SHORT,
+                                      (const void * const *)list.offset, list.shortSize, list.base);
+    if (list.size > list.shortSize)
+        glMultiDrawElementsBaseVertex(GL_TRIANGLES, list.count + list.shortSize, GL_UNSIGNED_INT,
+                                      (const void * const *)(list.offset + list.shortSize),
+                                      list.size - list.shortSize, list.base + list.shortSize);
+    glBindVertexArray(0);
+}
+
+/*
+ * Keep in obj->visible the draws of the meshes whose data is in the GL
+ * buffers and whose bounds touch the frustum, found walking bvh when there
+ * is one, and with occlusion are not
+ * behind the meshes it draws. Of those, meshlets must also be inside the
+ * frustum, visible and have triangles facing the eye, and detail levels
+ * must be the one objSelectLod() picked. Return how many meshes are drawn
+ * and leave how many are not in culled and occluded
+ */
+unsigned int
+objCull(Obj *obj, const Frustum *frustum, const Bvh *bvh, Occlusion *occlusion, unsigned int *culled, unsigned int *occluded)
+{
+    const Bounds *bounds;
+    const Mesh *mesh;
+    DrawList *all = &obj->draws, *out = &obj->visible;
+    unsigned int i, drawn;
+
+    if (bvh) {
+        memset(obj->meshVisible, 0, obj->size);
+        bvhCull(bvh, obj, frustum, obj->meshVisible);
+    }
+
+    for (i = 0; i < obj->size && !bvh; i++) {
+        mesh = obj->mesh + i;
+        obj->meshVisible[i] = mesh->indexSize
+                              && !cullSphere(frustum, mesh->center, mesh->radius)
+                              && !cullBox(frustum, mesh->min, mesh->max);
+    }
+
+    /* Meshes still uploading neither show nor hide others */
+    for (i = 0; i < obj->size; i++)
+        obj->meshVisible[i] &= obj->meshResident[i];
+
+    *occluded = 0;
+    if (occlusion) {
+        occludeRender(occlusion, obj, frustum);
+        for (i = 0; i < obj->size; i++) {
+            mesh = obj->mesh + i;
+            if (mesh->indexSize && obj->meshVisible[i] && occludeBox(occlusion, mesh->min, mesh->max)) {
+                obj->meshVisible[i] = 0;
+                (*occluded)++;
+            }
+        }
+    }
+
+    for (i = drawn = *culled = 0; i < obj->size; i++) {
+        if (!obj->mesh[i].indexSize) continue;
+        if (obj->meshVisible[i]) drawn++;
+        else                     (*culled)++;
+    }
+    *culled -= *occluded;
+
+    out->size = out->shortSize = 0;
+    for (i = 0; i < all->size; i++) {
+        if (obj->meshlet) {
+            bounds = &obj->meshlet[obj->drawSource[i]].bounds;
+            if (!obj->meshVisible[obj->meshlet[obj->drawSource[i]].mesh]
+                || cullSphere(frustum, bounds->center, bounds->radius) || cullCone(frustum, bounds)
+                || (occlusion && occludeSphere(occlusion, bounds->center, bounds->radius)))
+                continue;
+        } else if (!obj->meshVisible[obj->drawSource[i]]
+                   || (obj->lod && obj->lod[obj->drawSource[i]].level != obj->drawLevel[i])) {
+            continue;
+        }
+
+        out->count[out->size] = all->count[i];
+        out->base[out->size] = all->base[i];
+        out->offset[out->size++] = all->offset[i];
+        if (i < all->shortSize) out->shortSize++;
+    }
+    return drawn;
+}
+
+/*
+ * Pick for every mesh the coarsest level whose error, seen from the eye at
+ * the distance of the mesh bounds, stays under LOD_PIXELS. pixels is the
+ * length on screen of a unit at distance 1
+ */
+void
+objSelectLod(Obj *obj, const Frustum *frustum, float pixels)
+{
+    MeshLod *lod;
+    unsigned int i, j;
+    float d, distance;
+
+    for (i = 0; i < obj->size; i++) {
+        lod = obj->lod + i;
+        for (j = 0, distance = 0; j < 3; j++) {
+            d = obj->mesh[i].center[j] - frustum->eye.vector[j];
+            distance += d * d;
+        }
+        distance = sqrtf(distance) - obj->mesh[i].radius;
+
+        lod->level = 0;
+        if (distance <= 0) continue;
+        while (lod->level + 1 < OBJ_LOD_LEVELS
+               && lod->error[lod->level + 1] * pixels / distance <= LOD_PIXELS)
+            lod->level++;
+    }
+}
+
+/*
+ * Cast a ray from the eye through the cursor and print the mesh and the
+ * point of the model it hits first
+ */
+void
+objPick(const Obj *obj, const Bvh *bvh, GLFWwindow *window, Mat4 proj, Mat4 view, Mat4 world, Vec3 eye)
+{
+    Vec3 origin, target;
+    double x, y;
+    float d[3], dir[3], t;
+    unsigned int i, index, mesh;
+    int width, height;
+
+    glfwGetCursorPos(window, &x, &y);
+    glfwGetWindowSize(window, &width, &height);
+
+    /* Undo the projection, then the rotation of the view */
+    d[0] = (2 * x / width - 1) / proj.matrix[0][0];
+    d[1] = (1 - 2 * y / height) / proj.matrix[1][1];
+    d[2] = -1;
+    for (i = 0; i < 3; i++)
+        target.vector[i] = eye.vector[i] + view.matrix[0][i] * d[0]
+                         + view.matrix[1][i] * d[1] + view.matrix[2][i] * d[2];
+
+    origin = cullModelPoint(world, eye);
+    target = cullModelPoint(world, target);
+    for (i = 0; i < 3; i++)
+        dir[i] = target.vector[i] - origin.vector[i];
+
+    if (!bvhRay(bvh, obj, origin.vector, dir, &t, &index)) {
+        fprintf(stderr, "objPick(): nothing under the cursor\n");
+        return;
+    }
+
+    /* The meshes cover the index buffer in order */
+    for (mesh = 0; mesh + 1 < obj->size && obj->mesh[mesh + 1].indexOffset <= index; mesh++);
+    fprintf(stderr, "objPick(): mesh %u (%s) at %f %f %f\n", mesh,
+            obj->names + obj->material[obj->mesh[mesh].material].name,
+            origin.vector[0] + t * dir[0], origin.vector[1] + t * dir[1], origin.vector[2] + t * dir[2]);
+}
+
+struct Uniforms
+uniformsGet(unsigned int shader)
+{
+    struct Uniforms u;
+
+    shaderBindBlock(shader, "Camera", BLOCK_CAMERA);
+    shaderBindBlock(shader, "Light", BLOCK_LIGHT);
+
+    u.materials = shaderUniform(shader, "materials");
+    return u;
+}
+
+/*
+ * Create a uniform buffer holding data and attach it to binding
+ */
+unsigned int
+blockCreate(unsigned int binding, const void *data, size_t size)
+{
+    unsigned int ubo;
+
+    glGenBuffers(1, &ubo);
+    glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+    glBufferData(GL_UNIFORM_BUFFER, size, data, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    glBindBufferBase(GL_UNIFORM_BUFFER, binding, ubo);
+    return ubo;
+}
+
+/*
+ * Upload data to ubo only when it differs from last, the copy of what
+ * the buffer holds
+ */
+void
+blockUpdate(unsigned int ubo, void *last, const void *data, size_t size)
+{
+    if (!memcmp(last, data, size)) return;
+
+    memcpy(last, data, size);
+    glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, size, data);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+/*
+ * Read the model, from the cache when it is there, and build everything
+ * the options ask for without touching GL. With -q the VBO holds
+ * PackedVertex when the vertices fit, half the size, and the unpack
+ * transform of obj maps the normalized positions back to the model
+ */
+void *
+objLoad(void *arg)
+{
+    struct Load *load = (struct Load *)arg;
+    Obj obj;
     int i;
-    for (i = 0; i < obj.size; i++) {
-        shaderSetfv(shader, "mtl.ambient",  obj.mesh[i].material.ka, glUniform3fv);
-        shaderSetfv(shader, "mtl.diffuse",  obj.mesh[i].material.kd, glUniform3fv);
-        shaderSetfv(shader, "mtl.specular", obj.mesh[i].material.ks, glUniform3fv);
-        meshDraw(shader, obj.mesh[i]);
+
+    loadStage(load, "reading");
+    if (!useCache || !cacheLoad(load->path, &obj)) {
+        obj = objCreate(load->path, loadThreads);
+        if (useCache) cacheStore(load->path, obj);
+    }
+
+    if (mergeMeshes) {
+        loadStage(load, "merging meshes");
+        objMerge(&obj);
+    }
+    if (optimize) {
+        loadStage(load, "optimizing");
+        meshoptVertexCache(&obj);
+        meshoptVertexFetch(&obj);
+    }
+    if (useMeshlets) {
+        loadStage(load, "building meshlets");
+        meshoptMeshlets(&obj);
+    } else if (useLods) {
+        loadStage(load, "building detail levels");
+        meshoptLods(&obj);
+    }
+    if (useBvh) {
+        loadStage(load, "building hierarchies");
+        load->meshBvh = bvhBuild(&obj, 0, loadThreads);
+        load->triangleBvh = bvhBuild(&obj, 1, loadThreads);
+    }
+
+    loadStage(load, "building draws");
+    load->packed = quantize && meshoptQuantize(&obj, obj.unpackOffset, obj.unpackScale);
+    if (!load->packed) {
+        for (i = 0; i < 3; i++) {
+            obj.unpackOffset[i] = 0;
+            obj.unpackScale[i] = 1;
+        }
     }
+    load->sources = drawSetUp(&obj, &load->indexBytes);
+
+    pthread_mutex_lock(&load->lock);
+    load->obj = obj;
+    load->done = 1;
+    pthread_mutex_unlock(&load->lock);
+    return NULL;
+}
+
+void
+loadStage(struct Load *load, const char *stage)
+{
+    pthread_mutex_lock(&load->lock);
+    load->stage = stage;
+    pthread_mutex_unlock(&load->lock);
 }
 
 void
 usage(int exitStatus)
 {
-    fprintf(stderr, "Usage: mverse [-h] [-v vertexshader] [-f fragmentshader] objfile\n");
+    fprintf(stderr, "Usage: mverse [-h] [-C] [-M] [-O] [-q] [-s] [-m] [-l] [-b] [-o] [-k] [-j threads] [-u megabytes] [-v vertexshader] [-f fragmentshader] objfile\n");
     exit(exitStatus);
 }
 
@@ -322,7 +998,20 @@ int main(int argc, char *argv[])
     Obj obj;
     GLFWwindow *window;
     char *vertexFile, *fragmentFile; 
-    unsigned int shader;
+    unsigned int shader, cameraUBO, drawn, culled, occluded;
+    struct Load load;
+    const char *stage;
+    Occlusion occlusion;
+    Upload upload;
+    int clicked = 0, loaded = 0, released = 0;
+    struct Uniforms uniforms;
+    struct CameraBlock camera, cameraLast;
+    struct LightBlock light = {
+        .direction = {-0.2, -1.0, 0.3},
+        .ambient   = { 0.1,  0.1, 0.1},
+        .diffuse   = { 0.8,  0.8, 0.8},
+        .specular  = { 1.0,  1.0, 1.0},
+    };
 
     vertexFile = getenv("MVERSE_VERTEX");
     fragmentFile = getenv("MVERSE_FRAGMENT");
@@ -331,7 +1020,13 @@ int main(int argc, char *argv[])
     argv += optind;
     argc -= optind;
 
-    obj = objCreate(argv[0]);
+    /* The window opens and draws while the model loads */
+    memset(&load, 0, sizeof(load));
+    load.path = argv[0];
+    if (pthread_mutex_init(&load.lock, NULL) || pthread_create(&load.thread, NULL, objLoad, &load)) {
+        perror("main() Error");
+        exit(1);
+    }
 
     // glfw Init
     initGlfw();
@@ -350,8 +1045,15 @@ int main(int argc, char *argv[])
 
     initOpengl();
     shader = shaderCreateProgram(vertexFile, fragmentFile);
+    uniforms = uniformsGet(shader);
+
+    glUseProgram(shader);
+    shaderSet1i(uniforms.materials, 0);
 
-    objSetUp(obj);
+    memset(&camera, 0, sizeof(camera));
+    memset(&cameraLast, 0, sizeof(cameraLast));
+    cameraUBO = blockCreate(BLOCK_CAMERA, &cameraLast, sizeof(cameraLast));
+    blockCreate(BLOCK_LIGHT, &light, sizeof(light));
 
     struct Camera mainCamera = {
         .position = linearVec3(0.0, 0.0, 10.0),
@@ -360,23 +1062,43 @@ int main(int argc, char *argv[])
     };
 
     Mat4 model, view, proj;
-    Mat4 T, S, R;
+    Mat4 T, S, R, unpack, world;
+    Frustum frustum;
     float t, t0, dt;
     int width, height;
     char title[1024];
     t0 = 0;
+    unpack = linearMat4Identity(1.0);
 
     glEnable(GL_DEPTH_TEST);
+
     while (!glfwWindowShouldClose(window)) {
+        if (!loaded) {
+            pthread_mutex_lock(&load.lock);
+            loaded = load.done;
+            stage = load.stage;
+            pthread_mutex_unlock(&load.lock);
+
+            if (loaded) {
+                pthread_join(load.thread, NULL);
+                obj = load.obj;
+                objSetUp(&obj, &upload, &load);
+                unpack = linearMat4Mul(
+                        linearTranslate(obj.unpackOffset[0], obj.unpackOffset[1], obj.unpackOffset[2]),
+                        linearScale(obj.unpackScale[0], obj.unpackScale[1], obj.unpackScale[2]));
+                if (useOcclusion)
+                    occlusion = occludeCreate(&obj, loadThreads);
+
+                /* The normal cones drop back facing meshlets, draw the same way */
+                if (obj.meshlet) glEnable(GL_CULL_FACE);
+                fprintf(stderr, "main(): model ready after %.2f s\n", glfwGetTime());
+            }
+        }
+
         processInput(window);
         glClearColor(0.2f, 0.2f, 0.2f, 0.0f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         glfwGetWindowSize(window, &width, &height);
-        sprintf(title, "mverse: x: %f y: %f z: %f",
-                mainCamera.front.vector[0] + mainCamera.position.vector[0],
-                mainCamera.front.vector[1] + mainCamera.position.vector[1],
-                mainCamera.front.vector[2] + mainCamera.position.vector[2]);
-        glfwSetWindowTitle(window, title);
 
         t = (float)glfwGetTime();
         dt = t - t0;
@@ -387,26 +1109,68 @@ int main(int argc, char *argv[])
         T = linearTranslate(0.0, 0.0, 0.0);
         R = linearRotate(0, 1.0, 0.0, 0.0);
         S = linearScale(scale, scale, scale);
-        model = linearMat4Muln(3, T, R, S);
+        world = linearMat4Muln(3, T, R, S);
+        model = linearMat4Mul(world, unpack);
 
         glUseProgram(shader);
 
-        shaderSetMatrixfv(shader, "model", model.matrix[0], glUniformMatrix4fv);
-        shaderSetMatrixfv(shader, "proj", proj.matrix[0], glUniformMatrix4fv);
-        shaderSetMatrixfv(shader, "view", view.matrix[0], glUniformMatrix4fv);
-        shaderSetMatrixfv(shader, "rotNormals", R.matrix[0], glUniformMatrix4fv);
-        shaderSetfv(shader, "viewPos", mainCamera.position.vector, glUniform3fv);
+        camera.model = model;
+        camera.view = view;
+        camera.proj = proj;
+        camera.rotNormals = R;
+        memcpy(camera.viewPos, mainCamera.position.vector, sizeof(mainCamera.position.vector));
+        blockUpdate(cameraUBO, &cameraLast, &camera, sizeof(camera));
+
+        if (!loaded) {
+            sprintf(title, "mverse: %s %.900s", (stage) ? stage : "loading", load.path);
+            glfwSetWindowTitle(window, title);
+            glfwSwapBuffers(window);
+            glfwPollEvents();
+            continue;
+        }
 
-        shaderSetfv(shader, "dirLight.direction", vec3(-0.2, -1.0, 0.3), glUniform3fv);
-        shaderSetfv(shader, "dirLight.ambient",   vec3(0.1, 0.1, 0.1), glUniform3fv);
-        shaderSetfv(shader, "dirLight.diffuse",   vec3(0.8, 0.8, 0.8), glUniform3fv);
-        shaderSetfv(shader, "dirLight.specular",  vec3(1.0, 1.0, 1.0), glUniform3fv);
+        frustum = cullFrustum(proj, view, world, mainCamera.position);
+        uploadFrame(&upload, &obj, &frustum);
+        if (!upload.pending && !released && !keepHost) {
+            objRelease(&obj);
+            released = 1;
+        }
+        if (obj.lod) objSelectLod(&obj, &frustum, proj.matrix[1][1] * height / 2);
+        drawn = objCull(&obj, &frustum, (useBvh) ? &load.meshBvh : NULL,
+                        (useOcclusion) ? &occlusion : NULL, &culled, &occluded);
+        objDraw(obj);
+
+        if (useBvh && glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS) {
+            if (!clicked) objPick(&obj, &load.triangleBvh, window, proj, view, world, mainCamera.position);
+            clicked = 1;
+        } else {
+            clicked = 0;
+        }
 
-        objDraw(shader, obj);
+        sprintf(title, "mverse: x: %f y: %f z: %f meshes: %u drawn %u culled %u occluded",
+                mainCamera.front.vector[0] + mainCamera.position.vector[0],
+                mainCamera.front.vector[1] + mainCamera.position.vector[1],
+                mainCamera.front.vector[2] + mainCamera.position.vector[2],
+                drawn, culled, occluded);
+        if (upload.pending)
+            sprintf(title + strlen(title), " upload: %.1f MB left at %.0f MB/s", upload.pending / 1e6,
+                    (upload.seconds > 0) ? upload.done / 1e6 / upload.seconds : 0);
+        glfwSetWindowTitle(window, title);
 
         glfwSwapBuffers(window);
         glfwPollEvents();
     }
+
+    /* A model still loading goes with the process */
+    if (loaded) {
+        uploadFree(&upload);
+        if (useOcclusion) occludeFree(&occlusion);
+        if (useBvh) {
+            bvhFree(&load.meshBvh);
+            bvhFree(&load.triangleBvh);
+        }
+        objTearDown(&obj);
+    }
     glfwTerminate();
 
     return 0;
@@ -1,3 +1,8 @@
 #define vec3(x, y, z) linearVec3(x, y, z).vector
+#define MATERIAL_TEXELS 3   /* RGBA texels per material in the material buffer */
+#define BLOCK_CAMERA 0      /* uniform block binding points */
+#define BLOCK_LIGHT 1
+#define LOD_PIXELS 1.0f     /* largest error on screen a detail level may show */
+#define MAX_THREADS 256     /* largest -j */
 
 static float scale = 1;
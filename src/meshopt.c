@@ -0,0 +1,1362 @@
+/*
+ * This file is part of mverse
+ * Copyright (C) 2022  juanvalencia.xyz
+
+ * mverse is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <float.h>
+#include <math.h>
+
+#include "linear.h"
+#include "meshopt.h"
+
+/*
+ * Per mesh state of the Forsyth optimizer, vertices are renumbered from 0
+ * in the order the mesh uses them
+ */
+struct Forsyth {
+    unsigned int *indices;       /* mesh triangles with local vertex ids */
+    unsigned int *live;          /* triangles not emitted yet per vertex */
+    unsigned int *adjStart;      /* first entry of the vertex in adj */
+    unsigned int *adj;           /* triangles using each vertex */
+    int *cachePos;
+    float *score;
+    float *triScore;
+    unsigned char *emitted;
+};
+
+/*
+ * Per mesh state of the meshlet builder, vertices are local ids as in
+ * Forsyth
+ */
+struct Cluster {
+    unsigned int *indices;       /* mesh triangles with local vertex ids */
+    unsigned int *adjStart;      /* first entry of the vertex in adj */
+    unsigned int *adj;           /* triangles using each vertex */
+    unsigned int *taken;         /* 1 + the last meshlet using each vertex */
+    unsigned int *queued;        /* 1 + the last meshlet each triangle was a candidate of */
+    unsigned int *candidates;    /* triangles next to the meshlet being grown */
+    unsigned int *rank;          /* place of each triangle in morton */
+    uint64_t *morton;            /* Morton code of the centre << 32 | triangle */
+    float (*center)[3];
+    unsigned char *emitted;
+};
+
+/*
+ * Upper half of the symmetric 4x4 matrix giving the sum of squared
+ * distances to a set of planes: a00 a01 a02 a03 a11 a12 a13 a22 a23 a33
+ */
+struct Quadric {
+    double a[10];
+};
+
+struct Collapse {
+    unsigned int from, to;
+    float cost;
+};
+
+/*
+ * Per mesh state of the simplifier. Vertices are local ids as in Forsyth,
+ * the ones with the same position are welded to the first of them, which
+ * stands for the position in the quadrics and the collapses
+ */
+struct Simplify {
+    const Vertex *vertices;
+    unsigned int *indices;       /* current triangles with local vertex ids */
+    unsigned int *global;        /* vertex of the Obj for every local id */
+    unsigned int *weld;
+    unsigned int *wedgeStart;    /* first entry of the position in wedges */
+    unsigned int *wedges;        /* local ids sharing every position */
+    struct Quadric *quadric;
+    unsigned char *locked;       /* on the border of the mesh */
+    unsigned char *changed;      /* near a collapse of the current pass */
+    unsigned int *remap;
+    unsigned int *adjStart;
+    unsigned int *adj;
+    struct Collapse *collapses;
+};
+
+static unsigned int meshLocalize(const unsigned int *indices, unsigned int indexSize, unsigned int *map, unsigned int *local);
+static void forsythInit(struct Forsyth *f, unsigned int nTriangles, unsigned int nVertices);
+static void forsythFree(struct Forsyth *f);
+static void forsythOrder(struct Forsyth *f, unsigned int nTriangles, unsigned int nVertices, unsigned int *order);
+static float forsythScore(int cachePos, unsigned int live);
+static void clusterInit(struct Cluster *c, unsigned int nTriangles, unsigned int nVertices);
+static void clusterFree(struct Cluster *c);
+static void clusterOrder(struct Cluster *c, const Vertex *vertices, const unsigned int *indices,
+                         unsigned int nTriangles, unsigned int nVertices, unsigned int *order);
+static float clusterDistance(const float *p, const float *sum, unsigned int size);
+static unsigned int mortonSpread(unsigned int x);
+static void trianglesReorder(unsigned int *indices, const unsigned int *order, unsigned int nTriangles, unsigned int *copy);
+static PackedVertex packVertex(const Vertex *v, const float *offset, const float *scale);
+static unsigned int packNormal(const float *normal);
+static void unpackNormal(unsigned int packed, float *normal);
+static unsigned short floatToHalf(float value);
+static float halfToFloat(unsigned short half);
+static unsigned int simplifyInit(struct Simplify *s, const Obj *obj, const unsigned int *indices, unsigned int indexSize, unsigned int *map);
+static void simplifyFree(struct Simplify *s);
+static void simplifyLock(struct Simplify *s, unsigned int indexSize);
+static unsigned int simplifyPass(struct Simplify *s, unsigned int nVertices, unsigned int indexSize, unsigned int target, float *error);
+static int simplifyFlips(const struct Simplify *s, unsigned int from, unsigned int to);
+static unsigned int simplifyWedge(const struct Simplify *s, unsigned int position, const float *normal);
+static const float * simplifyPosition(const struct Simplify *s, unsigned int v);
+static void triangleNormal(const float *p0, const float *p1, const float *p2, float *normal);
+static void quadricPlane(struct Quadric *q, const float *normal, float d);
+static void quadricAdd(struct Quadric *q, const struct Quadric *r);
+static double quadricError(const struct Quadric *q, const float *v);
+static unsigned int positionHash(const float *position);
+static int collapseCompare(const void *a, const void *b);
+static int edgeCompare(const void *a, const void *b);
+
+/*
+ * Reorder the triangles of every mesh so consecutive triangles reuse the
+ * vertices still in the post-transform cache (Tom Forsyth, "Linear-Speed
+ * Vertex Cache Optimisation"). Prints the ACMR before and after
+ */
+void
+meshoptVertexCache(Obj *obj)
+{
+    struct Forsyth f;
+    unsigned int *map, *order, *copy, *indices;
+    unsigned int i, j, nTriangles, nVertices, maxIndices;
+    float before;
+
+    before = meshoptACMR(obj->indices, obj->indexSize, obj->vertexSize);
+
+    for (i = maxIndices = 0; i < obj->size; i++)
+        if (obj->mesh[i].indexSize > maxIndices) maxIndices = obj->mesh[i].indexSize;
+
+    map = (unsigned int *)malloc(obj->vertexSize * sizeof(unsigned int));
+    order = (unsigned int *)malloc((maxIndices / 3 + 1) * sizeof(unsigned int));
+    copy = (unsigned int *)malloc((maxIndices + 1) * sizeof(unsigned int));
+    if (map == NULL || order == NULL || copy == NULL) {
+        perror("meshoptVertexCache() Error");
+        exit(1);
+    }
+    memset(map, 0xff, obj->vertexSize * sizeof(unsigned int));
+
+    for (i = 0; i < obj->size; i++) {
+        indices = obj->indices + obj->mesh[i].indexOffset;
+        nTriangles = obj->mesh[i].indexSize / 3;
+        if (nTriangles < 2) continue;
+
+        forsythInit(&f, nTriangles, obj->mesh[i].indexSize);
+        nVertices = meshLocalize(indices, 3 * nTriangles, map, f.indices);
+        forsythOrder(&f, nTriangles, nVertices, order);
+        forsythFree(&f);
+        trianglesReorder(indices, order, nTriangles, copy);
+
+        /* Leave map clean for the next mesh */
+        for (j = 0; j < 3 * nTriangles; j++)
+            map[indices[j]] = UINT_MAX;
+    }
+
+    fprintf(stderr, "meshoptVertexCache(): ACMR %.3f -> %.3f\n",
+            before, meshoptACMR(obj->indices, obj->indexSize, obj->vertexSize));
+
+    free(map);
+    free(order);
+    free(copy);
+}
+
+/*
+ * Reorder the vertices in the order the index buffer first uses them and
+ * renumber the indices, so drawing walks the vertex buffer forward. Run it
+ * after meshoptVertexCache(), vertices no mesh uses go last
+ */
+void
+meshoptVertexFetch(Obj *obj)
+{
+    Vertex *copy;
+    unsigned int *map, i, n;
+
+    map = (unsigned int *)malloc((obj->vertexSize + 1) * sizeof(unsigned int));
+    copy = (Vertex *)malloc((obj->vertexSize + 1) * sizeof(Vertex));
+    if (map == NULL || copy == NULL) {
+        perror("meshoptVertexFetch() Error");
+        exit(1);
+    }
+    memset(map, 0xff, obj->vertexSize * sizeof(unsigned int));
+    memcpy(copy, obj->vertices, obj->vertexSize * sizeof(Vertex));
+
+    /* The meshes are consecutive ranges of the index buffer */
+    for (i = n = 0; i < obj->indexSize; i++) {
+        if (map[obj->indices[i]] == UINT_MAX) map[obj->indices[i]] = n++;
+        obj->indices[i] = map[obj->indices[i]];
+    }
+    for (i = 0; i < obj->vertexSize; i++)
+        if (map[i] == UINT_MAX) map[i] = n++;
+
+    for (i = 0; i < obj->vertexSize; i++)
+        obj->vertices[map[i]] = copy[i];
+
+    free(map);
+    free(copy);
+}
+
+/*
+ * Find the box the packed positions of obj are normalized to, return 0
+ * when the vertices don't fit in a PackedVertex. Prints the largest
+ * position, normal and texture coordinate error the packing introduces
+ */
+int
+meshoptQuantize(const Obj *obj, float offset[3], float scale[3])
+{
+    PackedVertex out;
+    const Vertex *v;
+    float max[3], position, normal[3], length, dot, uv;
+    float posError, normalError, uvError;
+    unsigned int i, j;
+
+    if (obj->vertexSize == 0) return 0;
+    if (obj->materialSize > USHRT_MAX + 1) {
+        fprintf(stderr, "meshoptQuantize() Warning: %u materials don't fit in 16 bits\n", obj->materialSize);
+        return 0;
+    }
+
+    for (j = 0; j < 3; j++)
+        offset[j] = max[j] = obj->vertices[0].position[j];
+    for (i = 1; i < obj->vertexSize; i++) {
+        for (j = 0; j < 3; j++) {
+            if (obj->vertices[i].position[j] < offset[j]) offset[j] = obj->vertices[i].position[j];
+            if (obj->vertices[i].position[j] > max[j])    max[j] = obj->vertices[i].position[j];
+        }
+    }
+    for (j = 0; j < 3; j++)
+        scale[j] = max[j] - offset[j];
+
+    posError = normalError = uvError = 0;
+    for (i = 0; i < obj->vertexSize; i++) {
+        v = obj->vertices + i;
+        out = packVertex(v, offset, scale);
+        for (j = 0; j < 3; j++) {
+            position = offset[j] + scale[j] * out.position[j] / USHRT_MAX;
+            posError = fmaxf(posError, fabsf(position - v->position[j]));
+        }
+        for (j = 0; j < 2; j++) {
+            uv = halfToFloat(out.texCoords[j]);
+            uvError = fmaxf(uvError, fabsf(uv - v->texCoords[j]));
+        }
+
+        length = sqrtf(v->normal[0] * v->normal[0] + v->normal[1] * v->normal[1] + v->normal[2] * v->normal[2]);
+        if (length > 0) {
+            unpackNormal(out.normal, normal);
+            dot = (normal[0] * v->normal[0] + normal[1] * v->normal[1] + normal[2] * v->normal[2])
+                / (length * sqrtf(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]));
+            normalError = fmaxf(normalError, acosf(fminf(dot, 1.0f)));
+        }
+    }
+
+    fprintf(stderr, "meshoptQuantize(): %u -> %u bytes per vertex, errors: position %g (%.2g of the bounding box), "
+            "normal %.3f degrees, texcoord %g\n",
+            (unsigned int)sizeof(Vertex), (unsigned int)sizeof(PackedVertex), posError,
+            posError / fmaxf(sqrtf(scale[0] * scale[0] + scale[1] * scale[1] + scale[2] * scale[2]), FLT_MIN),
+            normalError * 180 / M_PI, uvError);
+    return 1;
+}
+
+/*
+ * Pack count vertices of obj from first into out, in the box
+ * meshoptQuantize() found
+ */
+void
+meshoptPack(const Obj *obj, unsigned int first, unsigned int count, const float offset[3], const float scale[3],
+            PackedVertex *out)
+{
+    unsigned int i;
+
+    for (i = 0; i < count; i++)
+        out[i] = packVertex(obj->vertices + first + i, offset, scale);
+}
+
+PackedVertex
+packVertex(const Vertex *v, const float *offset, const float *scale)
+{
+    PackedVertex out;
+    unsigned int j;
+
+    for (j = 0; j < 3; j++)
+        out.position[j] = (scale[j] > 0)
+            ? (unsigned short)lroundf((v->position[j] - offset[j]) / scale[j] * USHRT_MAX)
+            : 0;
+    for (j = 0; j < 2; j++)
+        out.texCoords[j] = floatToHalf(v->texCoords[j]);
+    out.material = v->material;
+    out.normal = packNormal(v->normal);
+    return out;
+}
+
+/*
+ * Signed 10 bit components, the unit normal maps to [-511, 511]. The VBO
+ * hands them to the shaders as plain integers that they normalize, GL 3.3
+ * would decode snorm as (2c + 1) / 1023 and GL 4.2 as c / 511
+ */
+unsigned int
+packNormal(const float *normal)
+{
+    unsigned int i, packed = 0;
+    float length, c;
+
+    length = sqrtf(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+    for (i = 0; i < 3; i++) {
+        c = (length > 0) ? normal[i] / length : 0;
+        packed |= ((unsigned int)lroundf(c * 511) & 0x3ff) << (10 * i);
+    }
+    return packed;
+}
+
+void
+unpackNormal(unsigned int packed, float *normal)
+{
+    unsigned int i;
+    int c;
+
+    for (i = 0; i < 3; i++) {
+        c = (packed >> (10 * i)) & 0x3ff;
+        if (c & 0x200) c -= 0x400;
+        normal[i] = c / 511.0f;
+    }
+}
+
+/*
+ * IEEE half precision, rounded to nearest even
+ */
+unsigned short
+floatToHalf(float value)
+{
+    uint32_t bits, sign, mantissa, rest, half, shift;
+    int exponent;
+
+    memcpy(&bits, &value, sizeof(bits));
+    sign = (bits >> 16) & 0x8000;
+    mantissa = bits & 0x7fffff;
+    exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+
+    if (((bits >> 23) & 0xff) == 0xff)
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+    if (exponent >= 31)
+        return sign | 0x7c00;
+
+    if (exponent <= 0) {
+        if (exponent < -10) return sign;
+        mantissa |= 0x800000;
+        shift = 14 - exponent;
+        half = mantissa >> shift;
+        rest = mantissa & ((1u << shift) - 1);
+        if (rest > (1u << (shift - 1)) || (rest == (1u << (shift - 1)) && (half & 1))) half++;
+        return sign | half;
+    }
+
+    /* A carry out of the mantissa correctly bumps the exponent */
+    half = ((uint32_t)exponent << 10) | (mantissa >> 13);
+    rest = mantissa & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;
+    return sign | half;
+}
+
+float
+halfToFloat(unsigned short half)
+{
+    float value;
+    int exponent = (half >> 10) & 0x1f;
+    int mantissa = half & 0x3ff;
+
+    if (exponent == 0)       value = ldexpf(mantissa, -24);
+    else if (exponent == 31) value = mantissa ? NAN : INFINITY;
+    else                     value = ldexpf(mantissa | 0x400, exponent - 25);
+    return (half & 0x8000) ? -value : value;
+}
+
+/*
+ * Cut every mesh in meshlets of up to MESHLET_TRIANGLES triangles grown
+ * over shared vertices, see clusterOrder(), and reorder its triangles so
+ * every meshlet is a run of them. Each meshlet keeps the order it grew in,
+ * which reuses vertices about as well as meshoptVertexCache()
+ */
+void
+meshoptMeshlets(Obj *obj)
+{
+    struct Cluster c;
+    Meshlet *m;
+    unsigned int *map, *order, *copy, *indices;
+    unsigned int i, j, offset, end, size, nTriangles, nVertices, maxIndices;
+
+    for (i = maxIndices = 0; i < obj->size; i++)
+        if (obj->mesh[i].indexSize > maxIndices) maxIndices = obj->mesh[i].indexSize;
+
+    map = (unsigned int *)malloc((obj->vertexSize + 1) * sizeof(unsigned int));
+    order = (unsigned int *)malloc((maxIndices / 3 + 1) * sizeof(unsigned int));
+    copy = (unsigned int *)malloc((maxIndices + 1) * sizeof(unsigned int));
+    if (map == NULL || order == NULL || copy == NULL) {
+        perror("meshoptMeshlets() Error");
+        exit(1);
+    }
+    memset(map, 0xff, obj->vertexSize * sizeof(unsigned int));
+
+    for (i = 0; i < obj->size; i++) {
+        indices = obj->indices + obj->mesh[i].indexOffset;
+        nTriangles = obj->mesh[i].indexSize / 3;
+        if (nTriangles <= MESHLET_TRIANGLES) continue;
+
+        clusterInit(&c, nTriangles, 3 * nTriangles);
+        nVertices = meshLocalize(indices, 3 * nTriangles, map, c.indices);
+        clusterOrder(&c, obj->vertices, indices, nTriangles, nVertices, order);
+        clusterFree(&c);
+        trianglesReorder(indices, order, nTriangles, copy);
+
+        /* Leave map clean for the next mesh */
+        for (j = 0; j < 3 * nTriangles; j++)
+            map[indices[j]] = UINT_MAX;
+    }
+    free(map);
+    free(order);
+    free(copy);
+
+    for (i = size = 0; i < obj->size; i++)
+        size += (obj->mesh[i].indexSize / 3 + MESHLET_TRIANGLES - 1) / MESHLET_TRIANGLES;
+
+    obj->meshlet = (Meshlet *)malloc((size + 1) * sizeof(Meshlet));
+    if (obj->meshlet == NULL) {
+        perror("meshoptMeshlets() Error");
+        exit(1);
+    }
+
+    obj->meshletSize = 0;
+    for (i = 0; i < obj->size; i++) {
+        end = obj->mesh[i].indexOffset + obj->mesh[i].indexSize;
+        for (offset = obj->mesh[i].indexOffset; offset < end; offset += 3 * MESHLET_TRIANGLES) {
+            m = obj->meshlet + obj->meshletSize++;
+            m->mesh = i;
+            m->indexOffset = offset;
+            m->indexSize = (end - offset < 3 * MESHLET_TRIANGLES) ? end - offset : 3 * MESHLET_TRIANGLES;
+            meshoptBounds(obj, m->indexOffset, m->indexSize, &m->bounds);
+        }
+    }
+}
+
+void
+clusterInit(struct Cluster *c, unsigned int nTriangles, unsigned int nVertices)
+{
+    c->indices  = (unsigned int *)malloc(3 * nTriangles * sizeof(unsigned int));
+    c->adjStart = (unsigned int *)calloc(nVertices + 1, sizeof(unsigned int));
+    c->adj      = (unsigned int *)malloc(3 * nTriangles * sizeof(unsigned int));
+    c->taken    = (unsigned int *)calloc(nVertices, sizeof(unsigned int));
+    c->queued   = (unsigned int *)calloc(nTriangles, sizeof(unsigned int));
+    c->candidates = (unsigned int *)malloc(nTriangles * sizeof(unsigned int));
+    c->rank     = (unsigned int *)malloc(nTriangles * sizeof(unsigned int));
+    c->morton   = (uint64_t *)malloc(nTriangles * sizeof(uint64_t));
+    c->center   = (float (*)[3])malloc(nTriangles * sizeof(c->center[0]));
+    c->emitted  = (unsigned char *)calloc(nTriangles, 1);
+
+    if (!c->indices || !c->adjStart || !c->adj || !c->taken || !c->queued || !c->candidates || !c->rank
+        || !c->morton || !c->center || !c->emitted) {
+        perror("clusterInit() Error");
+        exit(1);
+    }
+}
+
+void
+clusterFree(struct Cluster *c)
+{
+    free(c->indices);
+    free(c->adjStart);
+    free(c->adj);
+    free(c->taken);
+    free(c->queued);
+    free(c->candidates);
+    free(c->rank);
+    free(c->morton);
+    free(c->center);
+    free(c->emitted);
+}
+
+/*
+ * Fill order with the triangles of c in meshlets of MESHLET_TRIANGLES, the
+ * way meshoptimizer's buildMeshlets grows them. A meshlet starts at the
+ * first triangle left in Morton order of the centres and takes the
+ * triangle next to it adding the fewest vertices, nearest to its centre
+ * first. When none is left it takes the nearest free triangle
+ * among MESHLET_WINDOW on each side of its latest one in Morton order, and
+ * only then the first one left
+ */
+void
+clusterOrder(struct Cluster *c, const Vertex *vertices, const unsigned int *indices,
+             unsigned int nTriangles, unsigned int nVertices, unsigned int *order)
+{
+    float lo[3], hi[3], sum[3], d, distance, bestDistance;
+    unsigned int i, j, n, v, t, best, bestExtra, extra, emitted, cursor, size, meshlet, first, last, nCandidates;
+    uint64_t code;
+
+    for (i = 0; i < 3 * nTriangles; i++)
+        c->adjStart[c->indices[i] + 1]++;
+    for (v = 0; v < nVertices; v++)
+        c->adjStart[v + 1] += c->adjStart[v];
+
+    /* adjStart[v] is used as a cursor while filling, then shifted back */
+    for (t = 0; t < nTriangles; t++)
+        for (j = 0; j < 3; j++)
+            c->adj[c->adjStart[c->indices[3 * t + j]]++] = t;
+    for (v = nVertices; v > 0; v--)
+        c->adjStart[v] = c->adjStart[v - 1];
+    c->adjStart[0] = 0;
+
+    for (j = 0; j < 3; j++) {
+        lo[j] = INFINITY;
+        hi[j] = -INFINITY;
+    }
+    for (t = 0; t < nTriangles; t++) {
+        for (j = 0; j < 3; j++) {
+            c->center[t][j] = (vertices[indices[3 * t]].position[j] + vertices[indices[3 * t + 1]].position[j]
+                               + vertices[indices[3 * t + 2]].position[j]) / 3;
+            if (c->center[t][j] < lo[j]) lo[j] = c->center[t][j];
+            if (c->center[t][j] > hi[j]) hi[j] = c->center[t][j];
+        }
+    }
+    for (t = 0; t < nTriangles; t++) {
+        for (j = code = 0; j < 3; j++) {
+            d = (hi[j] > lo[j]) ? (c->center[t][j] - lo[j]) / (hi[j] - lo[j]) : 0;
+            code |= (uint64_t)mortonSpread((unsigned int)(d * 1023)) << j;
+        }
+        c->morton[t] = code << 32 | t;
+    }
+    qsort(c->morton, nTriangles, sizeof(uint64_t), edgeCompare);
+    for (i = 0; i < nTriangles; i++)
+        c->rank[(unsigned int)c->morton[i]] = i;
+
+    cursor = size = meshlet = nCandidates = 0;
+    sum[0] = sum[1] = sum[2] = 0;
+    for (emitted = 0; emitted < nTriangles; emitted++) {
+        if (size == MESHLET_TRIANGLES) {
+            size = nCandidates = 0;
+            meshlet++;
+            sum[0] = sum[1] = sum[2] = 0;
+        }
+
+        best = UINT_MAX;
+        bestExtra = 4;
+        bestDistance = INFINITY;
+        for (i = n = 0; i < nCandidates; i++) {
+            t = c->candidates[i];
+            if (c->emitted[t]) continue;
+            c->candidates[n++] = t;
+            extra = (c->taken[c->indices[3 * t]] != meshlet + 1) + (c->taken[c->indices[3 * t + 1]] != meshlet + 1)
+                  + (c->taken[c->indices[3 * t + 2]] != meshlet + 1);
+            distance = clusterDistance(c->center[t], sum, size);
+            if (extra < bestExtra || (extra == bestExtra && distance < bestDistance)) {
+                best = t;
+                bestExtra = extra;
+                bestDistance = distance;
+            }
+        }
+        nCandidates = n;
+
+        if (best == UINT_MAX && size) {
+            last = c->rank[order[emitted - 1]];
+            first = (last > MESHLET_WINDOW) ? last - MESHLET_WINDOW : 0;
+            for (i = first; i < nTriangles && i <= last + MESHLET_WINDOW; i++) {
+                t = (unsigned int)c->morton[i];
+                if (c->emitted[t]) continue;
+                distance = clusterDistance(c->center[t], sum, size);
+                if (distance < bestDistance) {
+                    best = t;
+                    bestDistance = distance;
+                }
+            }
+        }
+
+        if (best == UINT_MAX) {
+            while (c->emitted[(unsigned int)c->morton[cursor]]) cursor++;
+            best = (unsigned int)c->morton[cursor];
+        }
+
+        c->emitted[best] = 1;
+        order[emitted] = best;
+        for (j = 0; j < 3; j++) {
+            v = c->indices[3 * best + j];
+            c->taken[v] = meshlet + 1;
+            sum[j] += c->center[best][j];
+            for (i = c->adjStart[v]; i < c->adjStart[v + 1]; i++) {
+                t = c->adj[i];
+                if (c->emitted[t] || c->queued[t] == meshlet + 1) continue;
+                c->queued[t] = meshlet + 1;
+                c->candidates[nCandidates++] = t;
+            }
+        }
+        size++;
+    }
+}
+
+/*
+ * Squared distance from p to the mean of size centres adding up to sum
+ */
+float
+clusterDistance(const float *p, const float *sum, unsigned int size)
+{
+    float d, distance;
+    unsigned int j;
+
+    for (j = 0, distance = 0; j < 3; j++) {
+        d = p[j] - sum[j] / size;
+        distance += d * d;
+    }
+    return distance;
+}
+
+/*
+ * The 10 low bits of x moved to every third bit
+ */
+unsigned int
+mortonSpread(unsigned int x)
+{
+    x &= 0x3ff;
+    x = (x | x << 16) & 0x30000ff;
+    x = (x | x << 8) & 0x300f00f;
+    x = (x | x << 4) & 0x30c30c3;
+    x = (x | x << 2) & 0x9249249;
+    return x;
+}
+
+/*
+ * Put the triangles of indices in order, copy has room for all of them
+ */
+void
+trianglesReorder(unsigned int *indices, const unsigned int *order, unsigned int nTriangles, unsigned int *copy)
+{
+    unsigned int i;
+
+    memcpy(copy, indices, 3 * nTriangles * sizeof(unsigned int));
+    for (i = 0; i < nTriangles; i++)
+        memcpy(indices + 3 * i, copy + 3 * order[i], 3 * sizeof(unsigned int));
+}
+
+/*
+ * Sphere around the box of the triangles and the cone holding their face
+ * normals. The cutoff is the sine of the angle between the widest normal
+ * and the axis, as used by cullCone()
+ */
+void
+meshoptBounds(const Obj *obj, unsigned int indexOffset, unsigned int indexSize, Bounds *bounds)
+{
+    const float *p[3];
+    float lo[3], hi[3], e1[3], e2[3], n[3], axis[3], length, d, minDot;
+    unsigned int i, j, k;
+
+    for (j = 0; j < 3; j++) {
+        lo[j] = INFINITY;
+        hi[j] = -INFINITY;
+        axis[j] = 0;
+    }
+
+    for (i = indexOffset; i < indexOffset + indexSize; i++) {
+        for (j = 0; j < 3; j++) {
+            d = obj->vertices[obj->indices[i]].position[j];
+            if (d < lo[j]) lo[j] = d;
+            if (d > hi[j]) hi[j] = d;
+        }
+    }
+
+    bounds->radius = 0;
+    for (j = 0; j < 3; j++)
+        bounds->center[j] = (indexSize) ? (lo[j] + hi[j]) / 2 : 0;
+    for (i = indexOffset; i < indexOffset + indexSize; i++) {
+        for (j = 0, length = 0; j < 3; j++) {
+            d = obj->vertices[obj->indices[i]].position[j] - bounds->center[j];
+            length += d * d;
+        }
+        if (length > bounds->radius) bounds->radius = length;
+    }
+    bounds->radius = sqrtf(bounds->radius);
+
+    /* Two passes over the face normals: their mean, then the widest one */
+    for (k = 0; k < 2; k++) {
+        minDot = 1;
+        for (i = indexOffset; i + 2 < indexOffset + indexSize; i += 3) {
+            for (j = 0; j < 3; j++)
+                p[j] = obj->vertices[obj->indices[i + j]].position;
+            for (j = 0; j < 3; j++) {
+                e1[j] = p[1][j] - p[0][j];
+                e2[j] = p[2][j] - p[0][j];
+            }
+            n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+            n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+            n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+            length = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+            if (length == 0) continue;
+
+            if (k == 0) {
+                for (j = 0; j < 3; j++) axis[j] += n[j] / length;
+            } else {
+                d = (n[0] * axis[0] + n[1] * axis[1] + n[2] * axis[2]) / length;
+                if (d < minDot) minDot = d;
+            }
+        }
+
+        if (k == 0) {
+            length = sqrtf(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+            if (length == 0) break;
+            for (j = 0; j < 3; j++) axis[j] /= length;
+        }
+    }
+
+    memcpy(bounds->axis, axis, sizeof(axis));
+    bounds->cutoff = (k == 2 && minDot > 0.1f) ? sqrtf(1 - minDot * minDot) : 2;
+}
+
+/*
+ * Build the detail levels of every mesh with edge collapses ordered by
+ * quadric error (Garland and Heckbert, "Surface Simplification Using
+ * Quadric Error Metrics"), each level continues from the one before. The
+ * border of a mesh is locked so the materials around it don't open
+ * cracks. Prints the triangles left and the largest error, relative to
+ * the mesh radius, of every level
+ */
+void
+meshoptLods(Obj *obj)
+{
+    struct Simplify s;
+    MeshLod *lod;
+    unsigned int *map, i, j, level, size, next, target, nVertices, capacity;
+    unsigned int triangles[OBJ_LOD_LEVELS];
+    float error, relative[OBJ_LOD_LEVELS];
+
+    capacity = obj->indexSize + 1;
+    obj->lod = (MeshLod *)calloc(obj->size + 1, sizeof(MeshLod));
+    obj->lodIndices = (unsigned int *)malloc(capacity * sizeof(unsigned int));
+    map = (unsigned int *)malloc((obj->vertexSize + 1) * sizeof(unsigned int));
+    if (obj->lod == NULL || obj->lodIndices == NULL || map == NULL) {
+        perror("meshoptLods() Error");
+        exit(1);
+    }
+    memset(map, 0xff, obj->vertexSize * sizeof(unsigned int));
+    memset(triangles, 0, sizeof(triangles));
+    memset(relative, 0, sizeof(relative));
+    obj->lodIndexSize = 0;
+
+    for (i = 0; i < obj->size; i++) {
+        lod = obj->lod + i;
+        size = obj->mesh[i].indexSize - obj->mesh[i].indexSize % 3;
+        lod->indexOffset[0] = obj->mesh[i].indexOffset;
+        lod->indexSize[0] = size;
+        triangles[0] += size / 3;
+
+        nVertices = simplifyInit(&s, obj, obj->indices + obj->mesh[i].indexOffset, size, map);
+        for (level = 1, error = 0; level < OBJ_LOD_LEVELS; level++) {
+            target = lod->indexSize[0] / 3 >> level;
+            while (size / 3 > target) {
+                next = simplifyPass(&s, nVertices, size, target, &error);
+                if (next == size) break;
+                size = next;
+            }
+
+            if (obj->lodIndexSize + size > capacity) {
+                capacity = 2 * capacity + size;
+                obj->lodIndices = (unsigned int *)realloc(obj->lodIndices, capacity * sizeof(unsigned int));
+                if (obj->lodIndices == NULL) {
+                    perror("meshoptLods() Error");
+                    exit(1);
+                }
+            }
+            lod->indexOffset[level] = obj->lodIndexSize;
+            lod->indexSize[level] = size;
+            for (j = 0; j < size; j++)
+                obj->lodIndices[obj->lodIndexSize++] = s.global[s.indices[j]];
+
+            lod->error[level] = sqrtf(error);
+            triangles[level] += size / 3;
+            if (obj->mesh[i].radius > 0 && lod->error[level] / obj->mesh[i].radius > relative[level])
+                relative[level] = lod->error[level] / obj->mesh[i].radius;
+        }
+
+        /* Leave map clean for the next mesh */
+        for (j = 0; j < nVertices; j++)
+            map[s.global[j]] = UINT_MAX;
+        simplifyFree(&s);
+    }
+
+    for (level = 1; level < OBJ_LOD_LEVELS; level++)
+        fprintf(stderr, "meshoptLods(): level %u: %u triangles (%.1f%%), error %.4f%%\n",
+                level, triangles[level], triangles[0] ? 100.0f * triangles[level] / triangles[0] : 0,
+                100 * relative[level]);
+
+    free(map);
+}
+
+/*
+ * Average cache miss ratio, vertex shader runs per triangle with a FIFO
+ * cache of MESHOPT_CACHE_SIZE vertices. 3 is the worst, 0.5 about the best
+ * a regular grid can do
+ */
+float
+meshoptACMR(const unsigned int *indices, unsigned int indexSize, unsigned int vertexSize)
+{
+    unsigned int *stamp, i, misses;
+
+    if (indexSize < 3) return 0;
+
+    stamp = (unsigned int *)calloc(vertexSize, sizeof(unsigned int));
+    if (stamp == NULL) {
+        perror("meshoptACMR() Error");
+        exit(1);
+    }
+
+    /* stamp holds the miss count after the vertex entered the cache */
+    for (i = misses = 0; i < indexSize; i++) {
+        if (stamp[indices[i]] && misses - stamp[indices[i]] < MESHOPT_CACHE_SIZE)
+            continue;
+        stamp[indices[i]] = ++misses;
+    }
+
+    free(stamp);
+    return (float)misses / (indexSize / 3);
+}
+
+/*
+ * Write indices renumbered from 0 in first use order into local, map goes
+ * from vertex to local id and must be UINT_MAX for unseen vertices.
+ * Return the number of vertices the mesh uses
+ */
+unsigned int
+meshLocalize(const unsigned int *indices, unsigned int indexSize, unsigned int *map, unsigned int *local)
+{
+    unsigned int i, n;
+
+    for (i = n = 0; i < indexSize; i++) {
+        if (map[indices[i]] == UINT_MAX) map[indices[i]] = n++;
+        local[i] = map[indices[i]];
+    }
+    return n;
+}
+
+void
+forsythInit(struct Forsyth *f, unsigned int nTriangles, unsigned int nVertices)
+{
+    f->indices  = (unsigned int *)malloc(3 * nTriangles * sizeof(unsigned int));
+    f->live     = (unsigned int *)calloc(nVertices, sizeof(unsigned int));
+    f->adjStart = (unsigned int *)calloc(nVertices + 1, sizeof(unsigned int));
+    f->adj      = (unsigned int *)malloc(3 * nTriangles * sizeof(unsigned int));
+    f->cachePos = (int *)malloc(nVertices * sizeof(int));
+    f->score    = (float *)malloc(nVertices * sizeof(float));
+    f->triScore = (float *)malloc(nTriangles * sizeof(float));
+    f->emitted  = (unsigned char *)calloc(nTriangles, 1);
+
+    if (!f->indices || !f->live || !f->adjStart || !f->adj || !f->cachePos
+        || !f->score || !f->triScore || !f->emitted) {
+        perror("forsythInit() Error");
+        exit(1);
+    }
+}
+
+void
+forsythFree(struct Forsyth *f)
+{
+    free(f->indices);
+    free(f->live);
+    free(f->adjStart);
+    free(f->adj);
+    free(f->cachePos);
+    free(f->score);
+    free(f->triScore);
+    free(f->emitted);
+}
+
+/*
+ * Fill order with the triangles of f in the order to draw them. Each step
+ * emits the best scored triangle touching the cache, the vertices of its
+ * neighbours are the only ones whose score changes
+ */
+void
+forsythOrder(struct Forsyth *f, unsigned int nTriangles, unsigned int nVertices, unsigned int *order)
+{
+    unsigned int cache[MESHOPT_CACHE_SIZE + 3], newCache[MESHOPT_CACHE_SIZE + 3];
+    unsigned int i, j, k, v, t, *tris, cacheSize, newSize, emitted, cursor;
+    int best;
+    float bestScore;
+
+    for (i = 0; i < 3 * nTriangles; i++)
+        f->live[f->indices[i]]++;
+
+    for (v = 0; v < nVertices; v++) {
+        f->adjStart[v + 1] = f->adjStart[v] + f->live[v];
+        f->cachePos[v] = -1;
+        f->score[v] = forsythScore(-1, f->live[v]);
+    }
+
+    /* adjStart[v] is used as a cursor while filling, then shifted back */
+    for (t = 0; t < nTriangles; t++)
+        for (j = 0; j < 3; j++)
+            f->adj[f->adjStart[f->indices[3 * t + j]]++] = t;
+    for (v = nVertices; v > 0; v--)
+        f->adjStart[v] = f->adjStart[v - 1];
+    f->adjStart[0] = 0;
+
+    best = 0;
+    bestScore = -1;
+    for (t = 0; t < nTriangles; t++) {
+        f->triScore[t] = f->score[f->indices[3 * t]] + f->score[f->indices[3 * t + 1]]
+                       + f->score[f->indices[3 * t + 2]];
+        if (f->triScore[t] > bestScore) {
+            bestScore = f->triScore[t];
+            best = t;
+        }
+    }
+
+    cacheSize = cursor = 0;
+    for (emitted = 0; emitted < nTriangles; emitted++) {
+
+        /* Nothing in the cache has triangles left, take the next one in input order */
+        if (best < 0) {
+            while (f->emitted[cursor]) cursor++;
+            best = cursor;
+        }
+
+        order[emitted] = best;
+        f->emitted[best] = 1;
+
+        newSize = 0;
+        for (j = 0; j < 3; j++) {
+            v = f->indices[3 * best + j];
+            tris = f->adj + f->adjStart[v];
+
+            /* Drop the triangle from the vertex adjacency */
+            for (k = 0; k < f->live[v]; k++) {
+                if (tris[k] == (unsigned int)best) {
+                    tris[k] = tris[--f->live[v]];
+                    break;
+                }
+            }
+
+            for (k = 0; k < newSize && newCache[k] != v; k++);
+            if (k == newSize) newCache[newSize++] = v;
+        }
+
+        for (i = 0; i < cacheSize; i++) {
+            for (k = 0; k < newSize && newCache[k] != cache[i]; k++);
+            if (k == newSize) newCache[newSize++] = cache[i];
+        }
+
+        for (i = 0; i < newSize; i++) {
+            v = newCache[i];
+            f->cachePos[v] = (i < MESHOPT_CACHE_SIZE) ? (int)i : -1;
+            f->score[v] = forsythScore(f->cachePos[v], f->live[v]);
+        }
+
+        best = -1;
+        bestScore = -1;
+        for (i = 0; i < newSize; i++) {
+            v = newCache[i];
+            tris = f->adj + f->adjStart[v];
+            for (k = 0; k < f->live[v]; k++) {
+                t = tris[k];
+                f->triScore[t] = f->score[f->indices[3 * t]] + f->score[f->indices[3 * t + 1]]
+                               + f->score[f->indices[3 * t + 2]];
+                if (f->triScore[t] > bestScore) {
+                    bestScore = f->triScore[t];
+                    best = t;
+                }
+            }
+        }
+
+        cacheSize = (newSize < MESHOPT_CACHE_SIZE) ? newSize : MESHOPT_CACHE_SIZE;
+        memcpy(cache, newCache, cacheSize * sizeof(unsigned int));
+    }
+}
+
+/*
+ * Vertices just used score higher than older cache entries, and vertices
+ * with few triangles left get a boost so they don't end up stranded
+ */
+float
+forsythScore(int cachePos, unsigned int live)
+{
+    float score = 0;
+
+    if (live == 0) return -1;
+
+    if (cachePos >= 0) {
+        if (cachePos < 3) score = 0.75f;
+        else score = powf(1.0f - (cachePos - 3) / (float)(MESHOPT_CACHE_SIZE - 3), 1.5f);
+    }
+    return score + 2.0f * powf((float)live, -0.5f);
+}
+
+/*
+ * Localize the indices of a mesh into s, weld its positions and sum the
+ * planes of the triangles around each of them. Return the number of
+ * vertices the mesh uses
+ */
+unsigned int
+simplifyInit(struct Simplify *s, const Obj *obj, const unsigned int *indices, unsigned int indexSize, unsigned int *map)
+{
+    unsigned int *table, i, j, n, v, mask;
+    const float *p[3];
+    float normal[3];
+    struct Quadric q;
+
+    s->vertices   = obj->vertices;
+    s->indices    = (unsigned int *)malloc((indexSize + 1) * sizeof(unsigned int));
+    s->global     = (unsigned int *)malloc((indexSize + 1) * sizeof(unsigned int));
+    s->weld       = (unsigned int *)malloc((indexSize + 1) * sizeof(unsigned int));
+    s->wedgeStart = (unsigned int *)calloc(indexSize + 2, sizeof(unsigned int));
+    s->wedges     = (unsigned int *)malloc((indexSize + 1) * sizeof(unsigned int));
+    s->quadric    = (struct Quadric *)calloc(indexSize + 1, sizeof(struct Quadric));
+    s->locked     = (unsigned char *)calloc(indexSize + 1, 1);
+    s->changed    = (unsigned char *)malloc(indexSize + 1);
+    s->remap      = (unsigned int *)malloc((indexSize + 1) * sizeof(unsigned int));
+    s->adjStart   = (unsigned int *)malloc((indexSize + 2) * sizeof(unsigned int));
+    s->adj        = (unsigned int *)malloc((indexSize + 1) * sizeof(unsigned int));
+    s->collapses  = (struct Collapse *)malloc((2 * indexSize + 1) * sizeof(struct Collapse));
+
+    if (!s->indices || !s->global || !s->weld || !s->wedgeStart || !s->wedges || !s->quadric
+        || !s->locked || !s->changed || !s->remap || !s->adjStart || !s->adj || !s->collapses) {
+        perror("simplifyInit() Error");
+        exit(1);
+    }
+
+    n = meshLocalize(indices, indexSize, map, s->indices);
+    for (i = 0; i < indexSize; i++)
+        s->global[s->indices[i]] = indices[i];
+
+    /* Open addressing table of the positions seen so far */
+    for (mask = 1; mask < 2 * n; mask <<= 1);
+    table = (unsigned int *)malloc(mask * sizeof(unsigned int));
+    if (table == NULL) {
+        perror("simplifyInit() Error");
+        exit(1);
+    }
+    memset(table, 0xff, mask * sizeof(unsigned int));
+    mask--;
+
+    for (v = 0; v < n; v++) {
+        p[0] = simplifyPosition(s, v);
+        for (i = positionHash(p[0]) & mask; table[i] != UINT_MAX; i = (i + 1) & mask)
+            if (!memcmp(simplifyPosition(s, table[i]), p[0], 3 * sizeof(float))) break;
+        if (table[i] == UINT_MAX) table[i] = v;
+        s->weld[v] = table[i];
+        s->wedgeStart[s->weld[v] + 1]++;
+    }
+    free(table);
+
+    for (v = 0; v < n; v++)
+        s->wedgeStart[v + 1] += s->wedgeStart[v];
+    for (v = 0; v < n; v++)
+        s->wedges[s->wedgeStart[s->weld[v]]++] = v;
+    for (v = n; v > 0; v--)
+        s->wedgeStart[v] = s->wedgeStart[v - 1];
+    s->wedgeStart[0] = 0;
+
+    for (i = 0; i < indexSize; i += 3) {
+        for (j = 0; j < 3; j++)
+            p[j] = simplifyPosition(s, s->indices[i + j]);
+        triangleNormal(p[0], p[1], p[2], normal);
+        if (normal[0] == 0 && normal[1] == 0 && normal[2] == 0) continue;
+
+        memset(&q, 0, sizeof(q));
+        quadricPlane(&q, normal, -(normal[0] * p[0][0] + normal[1] * p[0][1] + normal[2] * p[0][2]));
+        for (j = 0; j < 3; j++)
+            quadricAdd(s->quadric + s->weld[s->indices[i + j]], &q);
+    }
+
+    simplifyLock(s, indexSize);
+    return n;
+}
+
+void
+simplifyFree(struct Simplify *s)
+{
+    free(s->indices);
+    free(s->global);
+    free(s->weld);
+    free(s->wedgeStart);
+    free(s->wedges);
+    free(s->quadric);
+    free(s->locked);
+    free(s->changed);
+    free(s->remap);
+    free(s->adjStart);
+    free(s->adj);
+    free(s->collapses);
+}
+
+/*
+ * Lock the positions on an edge that doesn't join exactly two triangles,
+ * the open border of the mesh and its non manifold parts
+ */
+void
+simplifyLock(struct Simplify *s, unsigned int indexSize)
+{
+    uint64_t *edges, a, b;
+    unsigned int i, j;
+
+    edges = (uint64_t *)malloc((indexSize + 1) * sizeof(uint64_t));
+    if (edges == NULL) {
+        perror("simplifyLock() Error");
+        exit(1);
+    }
+
+    for (i = 0; i < indexSize; i++) {
+        a = s->weld[s->indices[i]];
+        b = s->weld[s->indices[(i % 3 == 2) ? i - 2 : i + 1]];
+        edges[i] = (a < b) ? a << 32 | b : b << 32 | a;
+    }
+    qsort(edges, indexSize, sizeof(uint64_t), edgeCompare);
+
+    for (i = 0; i < indexSize; i = j) {
+        for (j = i + 1; j < indexSize && edges[j] == edges[i]; j++);
+        if (j - i != 2) {
+            s->locked[edges[i] >> 32] = 1;
+            s->locked[edges[i] & 0xffffffff] = 1;
+        }
+    }
+    free(edges);
+}
+
+/*
+ * Collapse the cheapest edges whose neighbourhood no other collapse of the
+ * pass touched, until the mesh is down to target triangles. Keeps in error
+ * the largest cost taken and returns the new index count, indexSize when
+ * no edge could go
+ */
+unsigned int
+simplifyPass(struct Simplify *s, unsigned int nVertices, unsigned int indexSize, unsigned int target, float *error)
+{
+    unsigned int *idx = s->indices;
+    unsigned int i, j, k, t, a, b, m, v, from, to, live, collapsed, p[3];
+    struct Quadric q;
+    float normal[3];
+    double cost;
+
+    /* adjStart[v] is used as a cursor while filling, then shifted back */
+    memset(s->adjStart, 0, (nVertices + 1) * sizeof(unsigned int));
+    for (i = 0; i < indexSize; i++)
+        s->adjStart[s->weld[idx[i]] + 1]++;
+    for (v = 0; v < nVertices; v++)
+        s->adjStart[v + 1] += s->adjStart[v];
+    for (i = 0; i < indexSize; i++)
+        s->adj[s->adjStart[s->weld[idx[i]]]++] = i - i % 3;
+    for (v = nVertices; v > 0; v--)
+        s->adjStart[v] = s->adjStart[v - 1];
+    s->adjStart[0] = 0;
+
+    for (i = m = 0; i < indexSize; i++) {
+        a = s->weld[idx[i]];
+        b = s->weld[idx[(i % 3 == 2) ? i - 2 : i + 1]];
+        for (k = 0; k < 2; k++) {
+            from = k ? b : a;
+            to = k ? a : b;
+            if (s->locked[from]) continue;
+            q = s->quadric[from];
+            quadricAdd(&q, s->quadric + to);
+            cost = quadricError(&q, simplifyPosition(s, to));
+            s->collapses[m].from = from;
+            s->collapses[m].to = to;
+            s->collapses[m++].cost = (cost > 0) ? cost : 0;
+        }
+    }
+    qsort(s->collapses, m, sizeof(struct Collapse), collapseCompare);
+
+    for (v = 0; v < nVertices; v++) {
+        s->remap[v] = v;
+        s->changed[v] = 0;
+    }
+
+    live = indexSize / 3;
+    for (i = collapsed = 0; i < m && live > target; i++) {
+        a = s->collapses[i].from;
+        b = s->collapses[i].to;
+        if (s->changed[a] || s->changed[b] || simplifyFlips(s, a, b)) continue;
+
+        for (j = s->adjStart[a]; j < s->adjStart[a + 1]; j++) {
+            for (k = 0; k < 3; k++)
+                p[k] = s->weld[idx[s->adj[j] + k]];
+            if (p[0] == b || p[1] == b || p[2] == b) live--;
+            for (k = 0; k < 3; k++)
+                s->changed[p[k]] = 1;
+        }
+
+        s->remap[a] = b;
+        quadricAdd(s->quadric + b, s->quadric + a);
+        if (s->collapses[i].cost > *error) *error = s->collapses[i].cost;
+        collapsed++;
+    }
+    if (!collapsed) return indexSize;
+
+    /* A moved corner takes the wedge of its new position closest to the face */
+    for (i = t = 0; i < indexSize; i += 3) {
+        for (k = 0; k < 3; k++)
+            p[k] = s->remap[s->weld[idx[i + k]]];
+        if (p[0] == p[1] || p[1] == p[2] || p[0] == p[2]) continue;
+
+        triangleNormal(simplifyPosition(s, p[0]), simplifyPosition(s, p[1]),
+                       simplifyPosition(s, p[2]), normal);
+        for (k = 0; k < 3; k++)
+            idx[t + k] = (s->weld[idx[i + k]] == p[k]) ? idx[i + k] : simplifyWedge(s, p[k], normal);
+        t += 3;
+    }
+    return t;
+}
+
+/*
+ * Whether moving position from onto to turns over one of the triangles
+ * around it that stay
+ */
+int
+simplifyFlips(const struct Simplify *s, unsigned int from, unsigned int to)
+{
+    const float *p[3], *q[3];
+    float before[3], after[3];
+    unsigned int i, j, v;
+
+    for (i = s->adjStart[from]; i < s->adjStart[from + 1]; i++) {
+        for (j = 0; j < 3; j++) {
+            v = s->weld[s->indices[s->adj[i] + j]];
+            if (v == to) break;
+            p[j] = simplifyPosition(s, v);
+            q[j] = (v == from) ? simplifyPosition(s, to) : p[j];
+        }
+        if (j < 3) continue;
+
+        triangleNormal(p[0], p[1], p[2], before);
+        triangleNormal(q[0], q[1], q[2], after);
+        if (before[0] * after[0] + before[1] * after[1] + before[2] * after[2] <= 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Local vertex at position whose normal is the closest to normal
+ */
+unsigned int
+simplifyWedge(const struct Simplify *s, unsigned int position, const float *normal)
+{
+    const float *n;
+    unsigned int i, best;
+    float d, bestDot;
+
+    best = position;
+    bestDot = -INFINITY;
+    for (i = s->wedgeStart[position]; i < s->wedgeStart[position + 1]; i++) {
+        n = s->vertices[s->global[s->wedges[i]]].normal;
+        d = n[0] * normal[0] + n[1] * normal[1] + n[2] * normal[2];
+        if (d > bestDot) {
+            bestDot = d;
+            best = s->wedges[i];
+        }
+    }
+    return best;
+}
+
+const float *
+simplifyPosition(const struct Simplify *s, unsigned int v)
+{
+    return s->vertices[s->global[v]].position;
+}
+
+/*
+ * Unit normal of the triangle, zero when it has no area
+ */
+void
+triangleNormal(const float *p0, const float *p1, const float *p2, float *normal)
+{
+    float e1[3], e2[3], length;
+    int j;
+
+    for (j = 0; j < 3; j++) {
+        e1[j] = p1[j] - p0[j];
+        e2[j] = p2[j] - p0[j];
+    }
+    normal[0] = e1[1] * e2[2] - e1[2] * e2[1];
+    normal[1] = e1[2] * e2[0] - e1[0] * e2[2];
+    normal[2] = e1[0] * e2[1] - e1[1] * e2[0];
+
+    length = sqrtf(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+    for (j = 0; j < 3 && length > 0; j++)
+        normal[j] /= length;
+}
+
+/*
+ * q = p p^T for the plane p = (normal, d)
+ */
+void
+quadricPlane(struct Quadric *q, const float *normal, float d)
+{
+    double p[4] = {normal[0], normal[1], normal[2], d};
+    int i, j, k;
+
+    for (i = k = 0; i < 4; i++)
+        for (j = i; j < 4; j++)
+            q->a[k++] = p[i] * p[j];
+}
+
+void
+quadricAdd(struct Quadric *q, const struct Quadric *r)
+{
+    int i;
+
+    for (i = 0; i < 10; i++)
+        q->a[i] += r->a[i];
+}
+
+/*
+ * v^T q v with v = (x, y, z, 1)
+ */
+double
+quadricError(const struct Quadric *q, const float *v)
+{
+    const double *a = q->a;
+    double x = v[0], y = v[1], z = v[2];
+
+    return a[0] * x * x + 2 * a[1] * x * y + 2 * a[2] * x * z + 2 * a[3] * x
+         + a[4] * y * y + 2 * a[5] * y * z + 2 * a[6] * y
+         + a[7] * z * z + 2 * a[8] * z
+         + a[9];
+}
+
+/*
+ * FNV-1a of the bytes of a position
+ */
+unsigned int
+positionHash(const float *position)
+{
+    const unsigned char *c = (const unsigned char *)position;
+    unsigned int i, hash = 2166136261u;
+
+    for (i = 0; i < 3 * sizeof(float); i++) {
+        hash ^= c[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+int
+collapseCompare(const void *a, const void *b)
+{
+    float x = ((const struct Collapse *)a)->cost, y = ((const struct Collapse *)b)->cost;
+
+    return (x > y) - (x < y);
+}
+
+int
+edgeCompare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
@@ -0,0 +1,48 @@
+/*
+ * This file is part of mverse
+ * Copyright (C) 2022  juanvalencia.xyz
+
+ * mverse is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __MESHOPT__
+#define __MESHOPT__
+
+#include "obj.h"
+
+#define MESHOPT_CACHE_SIZE 32    /* vertices kept by the simulated post-transform cache */
+#define MESHLET_TRIANGLES 128
+#define MESHLET_WINDOW 64        /* triangles looked at around the last one in Morton order */
+
+/*
+ * 16 byte vertex for the GPU, the position is normalized to the bounding
+ * box of the Obj: position = offset + scale * position / 65535
+ */
+typedef struct {
+    unsigned short position[3];
+    unsigned short material;
+    unsigned int normal;            /* GL_INT_2_10_10_10_REV, not normalized */
+    unsigned short texCoords[2];    /* half floats */
+} PackedVertex;
+
+void meshoptVertexCache(Obj *obj);
+void meshoptVertexFetch(Obj *obj);
+int meshoptQuantize(const Obj *obj, float offset[3], float scale[3]);
+void meshoptPack(const Obj *obj, unsigned int first, unsigned int count, const float offset[3], const float scale[3],
+                 PackedVertex *out);
+void meshoptMeshlets(Obj *obj);
+void meshoptLods(Obj *obj);
+void meshoptBounds(const Obj *obj, unsigned int indexOffset, unsigned int indexSize, Bounds *bounds);
+float meshoptACMR(const unsigned int *indices, unsigned int indexSize, unsigned int vertexSize);
+#endif
@@ -16,10 +16,22 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "obj.h"
 
@@ -35,187 +47,641 @@ struct Seti {
     int v, vn, vt;
 };
 
-static void readV3(char *line, struct Setv3 **v, int vIndex);
-static void readV2(char *line, struct Setv2 **vn, int vtIndex);
-static void readF(char *line, Mesh *mesh, int meshIndex, struct Setv3 *v, struct Setv2 *vt, struct Setv3 *vn);
+/*
+ * Whole contents of an input file, mapped when it is a regular file and
+ * read into memory otherwise (pipes, stdin)
+ */
+struct Source {
+    char *data;
+    size_t size;
+    int mapped;
+};
+
+/*
+ * Growable array, the capacity doubles every time it fills up so appending
+ * an element is amortized constant time
+ */
+struct Array {
+    void *data;
+    unsigned int size, capacity;
+    size_t stride;
+};
+
+/*
+ * Open addressing table used to deduplicate vertices while loading, each
+ * slot holds a position in the vertex array plus one (0 marks an empty slot)
+ */
+struct VertexTable {
+    unsigned int *slots;
+    unsigned int capacity, size;
+};
+
+/*
+ * Material names, each stored once NUL terminated in chars, and an open
+ * addressing table of them. lib counts the mtllib lines read, a name
+ * defined by the last one is material of its slot
+ */
+struct NameSlot {
+    unsigned int name;      /* offset in chars plus one, 0 marks an empty slot */
+    unsigned int material, lib;
+};
+
+struct NameTable {
+    struct Array chars;
+    struct NameSlot *slots;
+    unsigned int capacity, size, lib;
+};
 
-static Material * readMtl(char *line, const char *path, int *size);
-static unsigned int useMtl(char *line, Material *mtl, unsigned int size);
+/*
+ * Everything objCreate() builds while going through the file in order
+ */
+struct Loader {
+    const char *filename;
+    struct Array v, vt, vn;
+    struct Array vertices, indices, meshes;
+    struct VertexTable table;
+    struct Array materials;
+    struct NameTable names;
+    struct Array libraries;          /* mtllib names, each NUL terminated */
+    unsigned int mtlBase, mtlSize;   /* materials of the last mtllib */
+    unsigned int material;           /* material of the faces being read */
+};
+
+/*
+ * Piece of the file parsed by a worker thread. Geometry records are kept
+ * in chunk order, faces are stored as triangulated corners and mtllib and
+ * usemtl lines are kept as events to replay in order when merging
+ */
+struct Chunk {
+    const char *begin, *end;
+    struct Array v, vt, vn;
+    struct Array corners, events;
+    pthread_t thread;
+};
+
+struct Event {
+    const char *key, *line, *end;
+    unsigned int corner;
+};
+
+static void loaderInit(struct Loader *loader, const char *filename, unsigned int hint);
+static Obj loaderFinish(struct Loader *loader);
+static void readSerial(struct Loader *loader, const char *ptr, const char *end);
+static void readParallel(struct Loader *loader, const char *ptr, const char *end, int nThreads);
+static void * chunkParse(void *chunk);
+static void chunkMerge(struct Loader *loader, struct Chunk *chunk);
+static void readEvent(struct Loader *loader, const char *key, const char *line, const char *end);
+
+static void readV3(const char *line, const char *end, struct Array *v);
+static void readV2(const char *line, const char *end, struct Array *vt);
+static void readF(const char *line, const char *end, struct Loader *loader);
+static void addCorners(struct Loader *loader, struct Seti *f, unsigned int nIndices);
+static void meshClose(struct Array *meshes, struct Array *indices);
+static void meshBounds(Mesh *mesh, const Vertex *vertices, const unsigned int *indices);
+
+static Material * readMtl(const char *line, const char *end, const char *path, struct NameTable *names, int *size);
+static unsigned int useMtl(const char *line, const char *end, struct NameTable *names, unsigned int fallback);
 
 /* -------------------------------------------------------------------------- */
 
-struct Seti * readIndices(char *line, int *nIndices);
-static int readIndex(char *line, struct Seti *f);
+struct Seti * readIndices(const char *line, const char *end, int *nIndices);
+static const char * readIndex(const char *ptr, const char *end, struct Seti *f);
 static Vertex createVertex(struct Seti f, struct Setv3 *v, struct Setv2 *vt, struct Setv3 *vn);
-static int vertexInVertices(Vertex vertex, Vertex *vertices, int nVertices);
-static void vertexAdd(Mesh *mesh, Vertex vertex);
-static int vertexGetIndex(Vertex *vertices,  Vertex vertex, int nVertices);
-static void indexAdd(Mesh *mesh, int index);
+static void vertexAdd(struct Array *vertices, Vertex vertex);
+static void indexAdd(struct Array *indices, unsigned int index);
+
+/* -------------------------------------------------------------------------- */
+static void arrayInit(struct Array *array, size_t stride, unsigned int hint);
+static void arrayReserve(struct Array *array, unsigned int capacity);
+static void * arrayAppend(struct Array *array);
+static void arrayExtend(struct Array *array, struct Array *tail);
+static void * arrayRelease(struct Array *array);
+
+/* -------------------------------------------------------------------------- */
+static void vertexTableInit(struct VertexTable *table, unsigned int capacity);
+static void vertexTableGrow(struct VertexTable *table, Vertex *vertices);
+static unsigned int vertexTableIndex(struct VertexTable *table, struct Array *vertices, Vertex vertex);
+static unsigned int vertexHash(Vertex vertex);
+static int vertexEqual(Vertex v1, Vertex v2);
+
+static void nameTableInit(struct NameTable *table, unsigned int capacity);
+static void nameTableGrow(struct NameTable *table);
+static struct NameSlot * nameTableFind(struct NameTable *table, const char *name, const char *end, int add);
+static unsigned int nameHash(const char *name, const char *end);
+
+/* -------------------------------------------------------------------------- */
+static int sourceOpen(struct Source *src, const char *filename);
+static int sourceRead(struct Source *src, FILE *fi);
+static void sourceClose(struct Source *src);
+static int nextLine(const char **ptr, const char *end, const char **line, const char **lineEnd);
+static int isBlank(char c);
+static const char * skipSpace(const char *ptr, const char *end);
+static const char * skipWord(const char *ptr, const char *end);
+static int wordIs(const char *word, const char *end, const char *str);
+static const char * copyWord(const char *ptr, const char *end, char *word, size_t size);
+static int readFloats(const char *ptr, const char *end, float *k, int n);
+static const char * parseFloat(const char *ptr, const char *end, float *out);
+static const char * parseInt(const char *ptr, const char *end, int *out);
+static int isDigit(char c);
+static int isEightDigits(const char *ptr);
+static uint32_t parseEightDigits(const char *ptr);
 
 /* -------------------------------------------------------------------------- */
 static void getDir(char *filepath);
-static void appendMtl(char *line, Material **mtl, int index);
-static void readColor(char *line, float *k);
+static void appendMtl(const char *line, const char *end, struct Array *mtl, struct NameTable *names);
+static void readColor(const char *line, const char *end, float *k);
 
 
 Obj
-objCreate(const char *filename)
+objCreate(const char *filename, int nThreads)
 {
     Obj o;
-    Mesh *mesh;
-    Material *mtl;
-    char lineBuffer[OBJ_LINE_MAX];
-    FILE *fi;
+    struct Source src;
+    struct Loader loader;
+    long chunks;
 
-    struct Setv3 *v, *vn;
-    struct Setv2 *vt;
-    int vSize, vtSize, vnSize;
-    vSize = vtSize = vnSize = 0;
+    if (sourceOpen(&src, filename)) {
+        perror("objCreateMesh() Error");
+        exit(1);
+    }
 
-    fi = (!strcmp(filename, "-")) ? stdin : fopen(filename, "r");
-    mesh = (Mesh *)calloc(1, sizeof(Mesh));
+    /* Guess the element counts from the file size */
+    loaderInit(&loader, filename, src.size / OBJ_HINT_BYTES);
 
-    // On error return NULL
-    if (fi == NULL || mesh == NULL) {
-        perror("objCreateMesh() Error");
-        fclose(fi);
+    /* Small files are not worth the threads */
+    chunks = (nThreads > 0) ? nThreads : sysconf(_SC_NPROCESSORS_ONLN);
+    if (chunks > (long)(src.size / OBJ_CHUNK_MIN))
+        chunks = src.size / OBJ_CHUNK_MIN;
+
+    if (chunks > 1) readParallel(&loader, src.data, src.data + src.size, chunks);
+    else            readSerial(&loader, src.data, src.data + src.size);
+
+    o = loaderFinish(&loader);
+    sourceClose(&src);
+
+    return o;
+}
+
+/*
+ * Merge the meshes of every material into one, in the order the materials
+ * are first used, and drop the empty ones. Fewer draws, but the bounds
+ * grow to cover every group of the material so culling drops less
+ */
+void
+objMerge(Obj *obj)
+{
+    unsigned int *merged, *indices, *offset, i, size;
+    Mesh *mesh, *out;
+
+    if (obj->indexSize == 0) return;
+
+    merged = (unsigned int *)malloc((obj->materialSize + 1) * sizeof(unsigned int));
+    offset = (unsigned int *)calloc(obj->size + 1, sizeof(unsigned int));
+    indices = (unsigned int *)malloc(obj->indexSize * sizeof(unsigned int));
+    out = (Mesh *)calloc(obj->size, sizeof(Mesh));
+    if (merged == NULL || offset == NULL || indices == NULL || out == NULL) {
+        perror("objMerge() Error");
         exit(1);
     }
 
-    v   = (struct Setv3 *)calloc(1, vSize  * sizeof(struct Setv3));
-    vt  = (struct Setv2 *)calloc(1, vtSize * sizeof(struct Setv2));
-    vn  = (struct Setv3 *)calloc(1, vnSize * sizeof(struct Setv3));
+    /* Mesh of every material and where its indices go */
+    memset(merged, 0xff, (obj->materialSize + 1) * sizeof(unsigned int));
+    for (i = size = 0; i < obj->size; i++) {
+        mesh = obj->mesh + i;
+        if (!mesh->indexSize) continue;
+        if (merged[mesh->material] == UINT_MAX) {
+            merged[mesh->material] = size;
+            out[size++].material = mesh->material;
+        }
+        out[merged[mesh->material]].indexSize += mesh->indexSize;
+    }
+    for (i = 1; i < size; i++)
+        out[i].indexOffset = out[i - 1].indexOffset + out[i - 1].indexSize;
+
+    for (i = 0; i < obj->size; i++) {
+        mesh = obj->mesh + i;
+        if (!mesh->indexSize) continue;
+        memcpy(indices + out[merged[mesh->material]].indexOffset + offset[merged[mesh->material]],
+               obj->indices + mesh->indexOffset, mesh->indexSize * sizeof(unsigned int));
+        offset[merged[mesh->material]] += mesh->indexSize;
+    }
+    memcpy(obj->indices, indices, obj->indexSize * sizeof(unsigned int));
+
+    for (i = 0; i < size; i++)
+        meshBounds(out + i, obj->vertices, obj->indices);
+
+    fprintf(stderr, "objMerge(): %u meshes merged into %u, one per material\n", obj->size, size);
+    free(obj->mesh);
+    obj->mesh = out;
+    obj->size = size;
+    free(merged);
+    free(offset);
+    free(indices);
+}
+
+/*
+ * Free everything obj holds in memory and unmap its cache, deleting the GL
+ * objects is left to whoever created them
+ */
+void
+objDestroy(Obj *obj)
+{
+    if (obj->cache) {
+        munmap(obj->cache, obj->cacheSize);
+    } else {
+        free(obj->vertices);
+        free(obj->indices);
+        free(obj->names);
+        free(obj->libraries);
+    }
+    free(obj->material);
+    free(obj->mesh);
+    free(obj->meshlet);
+    free(obj->lod);
+    free(obj->lodIndices);
+    free(obj->draws.count);
+    free(obj->draws.base);
+    free(obj->draws.offset);
+    free(obj->visible.count);
+    free(obj->visible.base);
+    free(obj->visible.offset);
+    free(obj->drawSource);
+    free(obj->drawLevel);
+    free(obj->meshVisible);
+    free(obj->meshResident);
+    memset(obj, 0, sizeof(*obj));
+}
 
-    if (v == NULL) {
-        fprintf(stderr, "objCreateMesh() Error: %s\n", strerror(errno));
+void
+loaderInit(struct Loader *loader, const char *filename, unsigned int hint)
+{
+    unsigned int tableSize;
+
+    loader->filename = filename;
+    loader->mtlBase = loader->mtlSize = 0;
+    loader->material = 0;
+
+    arrayInit(&loader->v,  sizeof(struct Setv3), hint);
+    arrayInit(&loader->vt, sizeof(struct Setv2), hint);
+    arrayInit(&loader->vn, sizeof(struct Setv3), hint);
+    arrayInit(&loader->vertices, sizeof(Vertex), hint);
+    arrayInit(&loader->indices, sizeof(unsigned int), 3 * hint);
+    arrayInit(&loader->meshes, sizeof(Mesh), 1);
+    arrayAppend(&loader->meshes);
+    arrayInit(&loader->materials, sizeof(Material), 1);
+    arrayAppend(&loader->materials);
+
+    for (tableSize = 1024; tableSize < 2 * hint; tableSize *= 2);
+    vertexTableInit(&loader->table, tableSize);
+
+    /* The default material is named "" */
+    arrayInit(&loader->names.chars, 1, 0);
+    nameTableInit(&loader->names, 64);
+    nameTableFind(&loader->names, "", "", 1);
+    arrayInit(&loader->libraries, 1, 0);
+}
+
+Obj
+loaderFinish(struct Loader *loader)
+{
+    Obj o;
+    unsigned int i;
+
+    meshClose(&loader->meshes, &loader->indices);
+
+    memset(&o, 0, sizeof(o));
+    o.size = loader->meshes.size;
+    o.mesh = (Mesh *)arrayRelease(&loader->meshes);
+    o.vertexSize = loader->vertices.size;
+    o.vertices = (Vertex *)arrayRelease(&loader->vertices);
+    o.indexSize = loader->indices.size;
+    o.indices = (unsigned int *)arrayRelease(&loader->indices);
+    o.materialSize = loader->materials.size;
+    o.material = (Material *)arrayRelease(&loader->materials);
+    o.nameSize = loader->names.chars.size;
+    o.names = (char *)arrayRelease(&loader->names.chars);
+    o.librarySize = loader->libraries.size;
+    o.libraries = (char *)arrayRelease(&loader->libraries);
+
+    for (i = 0; i < o.size; i++)
+        meshBounds(o.mesh + i, o.vertices, o.indices);
+
+    free(loader->v.data);
+    free(loader->vt.data);
+    free(loader->vn.data);
+    free(loader->table.slots);
+    free(loader->names.slots);
+
+    return o;
+}
+
+void
+readSerial(struct Loader *loader, const char *ptr, const char *end)
+{
+    const char *key, *line, *lineEnd;
+
+    while (nextLine(&ptr, end, &key, &lineEnd)) {
+
+        key = skipSpace(key, lineEnd);
+        line = skipWord(key, lineEnd);
+
+        if      (wordIs(key, line, "f" ))  readF (line, lineEnd, loader);
+        else if (wordIs(key, line, "vt"))  readV2(line, lineEnd, &loader->vt);
+        else if (wordIs(key, line, "vn"))  readV3(line, lineEnd, &loader->vn);
+        else if (wordIs(key, line, "v" ))  readV3(line, lineEnd, &loader->v);
+        else readEvent(loader, key, line, lineEnd);
+    }
+}
+
+/*
+ * Split [ptr, end) at line boundaries and parse the pieces on nThreads
+ * threads, then merge them in file order so the result is the same as
+ * readSerial()
+ */
+void
+readParallel(struct Loader *loader, const char *ptr, const char *end, int nThreads)
+{
+    struct Chunk *chunks;
+    const char *split;
+    int i;
+
+    chunks = (struct Chunk *)calloc(nThreads, sizeof(struct Chunk));
+    if (chunks == NULL) {
+        perror("readParallel() Error");
         exit(1);
     }
 
-    int n;
-    char key[500];
-    int vIndex, vtIndex, vnIndex;
-    int mtlSize, mtlIndex, meshIndex;
-    vIndex = vtIndex = vnIndex = meshIndex = mtlSize = 0;
+    for (i = 0; i < nThreads; i++) {
+        split = (i == nThreads - 1) ? end : ptr + (end - ptr) / (nThreads - i);
+        split = memchr(split, '\n', end - split);
+        split = (split) ? split + 1 : end;
 
-    while (fgets(lineBuffer, OBJ_LINE_MAX, fi)) {
+        chunks[i].begin = ptr;
+        chunks[i].end = split;
+        ptr = split;
 
-        sscanf(lineBuffer, "%s%n", key, &n);
+        if (pthread_create(&chunks[i].thread, NULL, chunkParse, chunks + i)) {
+            fprintf(stderr, "readParallel() Error: can't create thread\n");
+            exit(1);
+        }
+    }
+
+    for (i = 0; i < nThreads; i++)
+        pthread_join(chunks[i].thread, NULL);
+
+    for (i = 0; i < nThreads; i++) {
+        arrayExtend(&loader->v,  &chunks[i].v);
+        arrayExtend(&loader->vt, &chunks[i].vt);
+        arrayExtend(&loader->vn, &chunks[i].vn);
+    }
+
+    for (i = 0; i < nThreads; i++)
+        chunkMerge(loader, chunks + i);
 
-        if      (!strcmp("f" , key))  readF (lineBuffer + n, mesh, meshIndex, v, vt, vn);
-        else if (!strcmp("vt", key))  readV2(lineBuffer + n, &vt, vtIndex++);
-        else if (!strcmp("vn", key))  readV3(lineBuffer + n, &vn, vnIndex++);
-        else if (!strcmp("v" , key))  readV3(lineBuffer + n, &v,  vIndex++);
+    free(chunks);
+}
 
-        else if (!strcmp("mtllib", key)) mtl = readMtl(lineBuffer + n, filename, &mtlSize);
-        else if (!strcmp("usemtl", key) && mtlSize > 0) {
-            mtlIndex = useMtl (lineBuffer + n, mtl, mtlSize);
-            mesh = (Mesh *)realloc(mesh, (++meshIndex + 1) * sizeof(Mesh));
-            memset(mesh + meshIndex, 0, sizeof(Mesh));
-            mesh[meshIndex].material = mtl[mtlIndex];
-            mesh[meshIndex].indexSize = 0;
+void *
+chunkParse(void *arg)
+{
+    struct Chunk *chunk = (struct Chunk *)arg;
+    struct Event *event;
+    struct Seti *f;
+    const char *ptr, *key, *line, *lineEnd;
+    unsigned int hint;
+    int nIndices;
+
+    hint = (chunk->end - chunk->begin) / OBJ_HINT_BYTES;
+    arrayInit(&chunk->v,  sizeof(struct Setv3), hint);
+    arrayInit(&chunk->vt, sizeof(struct Setv2), hint);
+    arrayInit(&chunk->vn, sizeof(struct Setv3), hint);
+    arrayInit(&chunk->corners, sizeof(struct Seti), 3 * hint);
+    arrayInit(&chunk->events, sizeof(struct Event), 0);
+
+    ptr = chunk->begin;
+    while (nextLine(&ptr, chunk->end, &key, &lineEnd)) {
+
+        key = skipSpace(key, lineEnd);
+        line = skipWord(key, lineEnd);
+
+        if (wordIs(key, line, "f")) {
+            f = readIndices(line, lineEnd, &nIndices);
+            if (nIndices <= 0) continue;
+            arrayReserve(&chunk->corners, chunk->corners.size + nIndices);
+            memcpy((struct Seti *)chunk->corners.data + chunk->corners.size, f, nIndices * sizeof(struct Seti));
+            chunk->corners.size += nIndices;
+            free(f);
+        }
+        else if (wordIs(key, line, "vt"))  readV2(line, lineEnd, &chunk->vt);
+        else if (wordIs(key, line, "vn"))  readV3(line, lineEnd, &chunk->vn);
+        else if (wordIs(key, line, "v" ))  readV3(line, lineEnd, &chunk->v);
+        else if (wordIs(key, line, "mtllib") || wordIs(key, line, "usemtl")) {
+            event = (struct Event *)arrayAppend(&chunk->events);
+            event->key = key;
+            event->line = line;
+            event->end = lineEnd;
+            event->corner = chunk->corners.size;
         }
-        key[0] = '\0';
     }
+    return NULL;
+}
 
-    o.mesh = mesh;
-    o.size = meshIndex + 1;
-    for (int i = 1; i < o.size; i++) {
-        o.mesh[i].vertices = o.mesh[0].vertices;
-        o.mesh[i].vertexSize = o.mesh[0].vertexSize;
+/*
+ * Add the faces of chunk to the loader, replaying its mtllib and usemtl
+ * lines at the point they appeared in the file
+ */
+void
+chunkMerge(struct Loader *loader, struct Chunk *chunk)
+{
+    struct Seti *corners = (struct Seti *)chunk->corners.data;
+    struct Event *events = (struct Event *)chunk->events.data;
+    unsigned int i, corner;
+
+    for (i = corner = 0; i < chunk->events.size; i++) {
+        addCorners(loader, corners + corner, events[i].corner - corner);
+        readEvent(loader, events[i].key, events[i].line, events[i].end);
+        corner = events[i].corner;
     }
+    addCorners(loader, corners + corner, chunk->corners.size - corner);
 
-    free(v);
-    free(vt);
-    free(vn);
-    fclose(fi);
+    free(chunk->corners.data);
+    free(chunk->events.data);
+}
 
-    return o;
+/*
+ * Handle the lines that change the loader state: mtllib and usemtl
+ */
+void
+readEvent(struct Loader *loader, const char *key, const char *line, const char *end)
+{
+    Mesh *mesh;
+    Material *mtl;
+    struct NameSlot *slot;
+    const char *name;
+    int i, mtlSize;
+
+    if (wordIs(key, line, "mtllib")) {
+        name = skipSpace(line, end);
+        i = skipWord(name, end) - name;
+        arrayReserve(&loader->libraries, 2 * (loader->libraries.size + i + 1));
+        memcpy((char *)loader->libraries.data + loader->libraries.size, name, i);
+        ((char *)loader->libraries.data)[loader->libraries.size + i] = '\0';
+        loader->libraries.size += i + 1;
+
+        mtl = readMtl(line, end, loader->filename, &loader->names, &mtlSize);
+        loader->mtlBase = loader->materials.size;
+        loader->mtlSize = mtlSize;
+        loader->names.lib++;
+
+        /* The first material of a name wins, as usemtl used to search */
+        for (i = 0; i < mtlSize; i++) {
+            *(Material *)arrayAppend(&loader->materials) = mtl[i];
+            name = (const char *)loader->names.chars.data + mtl[i].name;
+            slot = nameTableFind(&loader->names, name, name + strlen(name), 0);
+            if (slot->lib == loader->names.lib) continue;
+            slot->lib = loader->names.lib;
+            slot->material = loader->mtlBase + i;
+        }
+        free(mtl);
+    } else if (wordIs(key, line, "usemtl") && loader->mtlSize > 0) {
+        loader->material = useMtl(line, end, &loader->names, loader->mtlBase);
+        meshClose(&loader->meshes, &loader->indices);
+        mesh = (Mesh *)arrayAppend(&loader->meshes);
+        mesh->material = loader->material;
+        mesh->indexOffset = loader->indices.size;
+    }
 }
 
+/*
+ * The last mesh owns every index read since it started
+ */
 void
-readF(char *line,
-      Mesh *mesh,
-	  int meshIndex,
-	  struct Setv3 *v,
-	  struct Setv2 *vt,
-	  struct Setv3 *vn
-      )
+meshClose(struct Array *meshes, struct Array *indices)
+{
+    Mesh *mesh = (Mesh *)meshes->data + meshes->size - 1;
+    mesh->indexSize = indices->size - mesh->indexOffset;
+}
+
+/*
+ * Box of the vertices the mesh uses and the sphere around its centre that
+ * holds them, all zero for an empty mesh
+ */
+void
+meshBounds(Mesh *mesh, const Vertex *vertices, const unsigned int *indices)
+{
+    const float *p;
+    unsigned int i, j;
+    float d, length;
+
+    for (j = 0; j < 3; j++) {
+        mesh->min[j] = (mesh->indexSize) ? INFINITY : 0;
+        mesh->max[j] = (mesh->indexSize) ? -INFINITY : 0;
+    }
+    for (i = mesh->indexOffset; i < mesh->indexOffset + mesh->indexSize; i++) {
+        p = vertices[indices[i]].position;
+        for (j = 0; j < 3; j++) {
+            if (p[j] < mesh->min[j]) mesh->min[j] = p[j];
+            if (p[j] > mesh->max[j]) mesh->max[j] = p[j];
+        }
+    }
+
+    mesh->radius = 0;
+    for (j = 0; j < 3; j++)
+        mesh->center[j] = (mesh->min[j] + mesh->max[j]) / 2;
+    for (i = mesh->indexOffset; i < mesh->indexOffset + mesh->indexSize; i++) {
+        p = vertices[indices[i]].position;
+        for (j = 0, length = 0; j < 3; j++) {
+            d = p[j] - mesh->center[j];
+            length += d * d;
+        }
+        if (length > mesh->radius) mesh->radius = length;
+    }
+    mesh->radius = sqrtf(mesh->radius);
+}
+
+void
+readF(const char *line, const char *end, struct Loader *loader)
 {
-    Vertex vertexBuffer;
     struct Seti *f;
-    int i, nIndices, vi;
-    f = readIndices(line, &nIndices);
+    int nIndices;
+
+    f = readIndices(line, end, &nIndices);
+    addCorners(loader, f, nIndices);
+    free(f);
+}
+
+void
+addCorners(struct Loader *loader, struct Seti *f, unsigned int nIndices)
+{
+    Vertex vertexBuffer;
+    unsigned int i, vi;
 
     for (i = 0; i < nIndices; i++) {
-        vertexBuffer = createVertex(f[i], v, vt, vn);
-        if (!vertexInVertices(vertexBuffer, mesh->vertices, mesh->vertexSize))
-            vertexAdd(mesh, vertexBuffer); 
-        vi = vertexGetIndex(mesh->vertices, vertexBuffer, mesh->vertexSize);
-        indexAdd(mesh + meshIndex, vi);
+        vertexBuffer = createVertex(f[i], loader->v.data, loader->vt.data, loader->vn.data);
+        vertexBuffer.material = loader->material;
+        vi = vertexTableIndex(&loader->table, &loader->vertices, vertexBuffer);
+        indexAdd(&loader->indices, vi);
     }
-    free(f);
 }
 
 void
-readV3(char *line, struct Setv3 **v, int vIndex)
+readV3(const char *line, const char *end, struct Array *v)
 {
-    int i, n;
-    char *ptr;
     struct Setv3 *vptr;
 
-    if (vIndex > 0)
-        *v = (struct Setv3 *)realloc(*v, (vIndex + 1) * sizeof(struct Setv3));
-
-    vptr = *v;
-    for (i = 0, ptr = line, n = 0; i < 3; i++, ptr += n)
-        sscanf(ptr, " %f%n", vptr[vIndex].data + i, &n);
+    vptr = (struct Setv3 *)arrayAppend(v);
+    readFloats(line, end, vptr->data, 3);
 }
 
 void
-readV2(char *line, struct Setv2 **v, int vIndex)
+readV2(const char *line, const char *end, struct Array *v)
 {
-    int i, n;
-    char *ptr;
     struct Setv2 *vptr;
 
-    if (vIndex > 0)
-        *v = (struct Setv2 *)realloc(*v, (vIndex + 1) * sizeof(struct Setv2));
-
-    vptr = *v;
-    for (i = 0, ptr = line, n = 0; i < 2; i++, ptr += n)
-        sscanf(line, " %f%n", vptr[vIndex].data + i, &n);
+    vptr = (struct Setv2 *)arrayAppend(v);
+    readFloats(line, end, vptr->data, 2);
 }
 
 struct Seti *
-readIndices(char *line, int *nIndices)
+readIndices(const char *line, const char *end, int *nIndices)
 {
     struct Seti *f;
     struct Seti *buffer;
-    char *ptr;
+    struct Array corners;
+    const char *ptr;
     int bufferSize;
-    int n;
-
-    buffer = (struct Seti *)calloc(3, sizeof(struct Seti));
-    for (ptr = line, bufferSize = 0; *ptr != '\n'; ptr += n, bufferSize++) {
-        if (bufferSize + 1 > 3)
-            buffer = (struct Seti *)realloc(buffer, (bufferSize + 1) * sizeof(struct Seti));
 
-        n = readIndex(ptr, buffer + bufferSize);
+    arrayInit(&corners, sizeof(struct Seti), 4);
+    ptr = skipSpace(line, end);
+    for (bufferSize = 0; ptr < end; ptr = skipSpace(ptr, end), bufferSize++) {
+        arrayAppend(&corners);
+        buffer = (struct Seti *)corners.data;
+        ptr = readIndex(ptr, end, buffer + bufferSize);
 
         if (buffer[bufferSize].v  != -1) buffer[bufferSize].v--;
         if (buffer[bufferSize].vt != -1) buffer[bufferSize].vt--;
         if (buffer[bufferSize].vn != -1) buffer[bufferSize].vn--;
 
-        if (n > 0) continue;
+        if (ptr != NULL && (ptr == end || isBlank(*ptr))) continue;
 
-        memset(buffer, 0, (bufferSize + 1) * sizeof(struct Seti));
-        free(buffer);
-        fprintf(stderr, "readIndices() Error: bad format in line '%s'", line);
+        free(corners.data);
+        fprintf(stderr, "readIndices() Error: bad format in line '%.*s'\n", (int)(end - line), line);
         exit(1);
     }
 
+    /* Faces with less than 3 corners have no triangles */
+    if (bufferSize < 3) {
+        free(corners.data);
+        *nIndices = 0;
+        return NULL;
+    }
+
     *nIndices = (bufferSize - 2) * 3;
     f = (struct Seti *)calloc(nIndices[0], sizeof(struct Seti));
+    if (f == NULL) {
+        perror("readIndices() Error");
+        exit(1);
+    }
 
     int i, j, k;
 
@@ -244,34 +710,33 @@ readIndices(char *line, int *nIndices)
         }
     }
 
-    free(buffer);
+    free(corners.data);
     return f;
 }
 
-int
-readIndex(char *line, struct Seti *f)
+/*
+ * Read a face corner "v", "v/vt", "v//vn" or "v/vt/vn" in a single pass,
+ * return a pointer past it or NULL when ptr doesn't start with an index
+ */
+const char *
+readIndex(const char *ptr, const char *end, struct Seti *f)
 {
-    int n;
-    f->v = f->vt = f->vn = -1;
-    if ((sscanf(line, " %d/%d/%d%n", &f->v, &f->vn, &f->vt, &n) >= 3)) return n;
-
-    f->v = f->vt = f->vn = -1;
-    if ((sscanf(line, " %d//%d%n",   &f->v, &f->vn, &n)         >= 2)) return n;
-
     f->v = f->vt = f->vn = -1;
-    if ((sscanf(line, " %d/%d%n",    &f->v, &f->vt, &n)         >= 2)) return n;
+    if ((ptr = parseInt(ptr, end, &f->v)) == NULL) return NULL;
+    if (ptr == end || *ptr != '/') return ptr;
 
-    f->v = f->vt = f->vn = -1;
-    if ((sscanf(line, " %d%n",       &f->v, &n)                 >= 1)) return n;
+    if (++ptr < end && *ptr != '/')
+        if ((ptr = parseInt(ptr, end, &f->vt)) == NULL) return NULL;
+    if (ptr == end || *ptr != '/') return ptr;
 
-    return 0;
+    return parseInt(ptr + 1, end, &f->vn);
 }
 
 Vertex
 createVertex(struct Seti f, struct Setv3 *v, struct Setv2 *vt, struct Setv3 *vn)
 {
     int i;
-    Vertex out = {.position = {0, 0, 0}, .normal = {0, 0, 0}, .texCoords = {0, 0}};
+    Vertex out = {.position = {0, 0, 0}, .normal = {0, 0, 0}, .texCoords = {0, 0}, .material = 0};
     for (i = 0; i < 3; i++) {
         if (f.v != -1) out.position[i] = v[f.v].data[i];
         if (f.vn != -1) out.normal[i] = vn[f.vn].data[i];
@@ -280,149 +745,372 @@ createVertex(struct Seti f, struct Setv3 *v, struct Setv2 *vt, struct Setv3 *vn)
     return out;
 }
 
-int
-vertexInVertices(Vertex vertex, Vertex *vertices, int nVertices)
+void
+vertexAdd(struct Array *vertices, Vertex vertex)
 {
-    return vertexGetIndex(vertices, vertex, nVertices) + 1;
+    *(Vertex *)arrayAppend(vertices) = vertex;
 }
 
-int
-vertexGetIndex(Vertex *vertices, Vertex vertex, int nVertices) {
-    int i, j, n;
-    for (i = 0; i < nVertices; i++) {
-        n = 0;
-        for (j = 0; j < 3; j++) {
-            if (vertices[i].position[j] == vertex.position[j]) n++;
-            if (vertices[i].normal[j] == vertex.normal[j]) n++;
-        }
-        for (j = 0; j < 2; j++) {
-            if (vertices[i].texCoords[j] == vertex.texCoords[j]) n++;
-        }
+void
+indexAdd(struct Array *indices, unsigned int index)
+{
+    *(unsigned int *)arrayAppend(indices) = index;
+}
 
-        if (n == 8) return i;
+void
+arrayInit(struct Array *array, size_t stride, unsigned int hint)
+{
+    array->data = NULL;
+    array->size = array->capacity = 0;
+    array->stride = stride;
+    if (hint) arrayReserve(array, hint);
+}
+
+void
+arrayReserve(struct Array *array, unsigned int capacity)
+{
+    void *data;
+
+    if (capacity <= array->capacity) return;
+
+    data = realloc(array->data, capacity * array->stride);
+    if (data == NULL) {
+        fprintf(stderr, "arrayReserve() Error: %s\n", strerror(errno));
+        exit(1);
     }
-    return -1;
+    array->data = data;
+    array->capacity = capacity;
+}
+
+/*
+ * Return a zeroed slot at the end of the array
+ */
+void *
+arrayAppend(struct Array *array)
+{
+    char *slot;
+
+    if (array->size == array->capacity)
+        arrayReserve(array, array->capacity ? 2 * array->capacity : 16);
+
+    slot = (char *)array->data + array->size++ * array->stride;
+    memset(slot, 0, array->stride);
+    return slot;
 }
 
+/*
+ * Move the elements of tail to the end of array and free tail
+ */
 void
-vertexAdd(Mesh *mesh, Vertex vertex)
+arrayExtend(struct Array *array, struct Array *tail)
 {
-    Vertex *v;
-    int i;
-    unsigned int vSize;
+    if (tail->size) {
+        arrayReserve(array, array->size + tail->size);
+        memcpy((char *)array->data + array->size * array->stride, tail->data, tail->size * tail->stride);
+        array->size += tail->size;
+    }
+    free(tail->data);
+    tail->data = NULL;
+    tail->size = tail->capacity = 0;
+}
 
-    v = mesh->vertices;
-    vSize = mesh->vertexSize;
+/*
+ * Shrink the array to its size and give its data to the caller
+ */
+void *
+arrayRelease(struct Array *array)
+{
+    void *data = array->data;
+
+    if (!array->size) {
+        free(data);
+        data = NULL;
+    } else if (array->size < array->capacity) {
+        data = realloc(data, array->size * array->stride);
+        if (data == NULL) data = array->data;
+    }
+    array->data = NULL;
+    array->size = array->capacity = 0;
+    return data;
+}
 
-    if (!vSize) v = (Vertex *)calloc(1, sizeof(Vertex));
-    else        v = (Vertex *)realloc(v, (vSize + 1) * sizeof(Vertex));
+void
+vertexTableInit(struct VertexTable *table, unsigned int capacity)
+{
+    table->size = 0;
+    table->capacity = capacity;
+    table->slots = (unsigned int *)calloc(capacity, sizeof(unsigned int));
 
-    if (v == NULL) {
-        fprintf(stderr, "vertexAdd() Error: %s\n", strerror(errno));
+    if (table->slots == NULL) {
+        fprintf(stderr, "vertexTableInit() Error: %s\n", strerror(errno));
         exit(1);
     }
+}
+
+void
+vertexTableGrow(struct VertexTable *table, Vertex *vertices)
+{
+    unsigned int i, j, mask, *slots;
+
+    slots = table->slots;
+    mask = table->capacity - 1;
+    vertexTableInit(table, 2 * table->capacity);
+
+    for (i = 0; i <= mask; i++) {
+        if (!slots[i]) continue;
+        j = vertexHash(vertices[slots[i] - 1]) & (table->capacity - 1);
+        while (table->slots[j])
+            j = (j + 1) & (table->capacity - 1);
+        table->slots[j] = slots[i];
+        table->size++;
+    }
+    free(slots);
+}
 
+/*
+ * Return the position of vertex in the vertex array, appending it when no
+ * equal vertex has been loaded yet
+ */
+unsigned int
+vertexTableIndex(struct VertexTable *table, struct Array *vertices, Vertex vertex)
+{
+    unsigned int i, mask;
+    Vertex *data = (Vertex *)vertices->data;
+
+    if (2 * (table->size + 1) > table->capacity)
+        vertexTableGrow(table, data);
+
+    mask = table->capacity - 1;
+    for (i = vertexHash(vertex) & mask; table->slots[i]; i = (i + 1) & mask) {
+        if (vertexEqual(data[table->slots[i] - 1], vertex))
+            return table->slots[i] - 1;
+    }
+
+    vertexAdd(vertices, vertex);
+    table->slots[i] = vertices->size;
+    table->size++;
+    return vertices->size - 1;
+}
+
+/*
+ * Hash the vertex components, 0.0 and -0.0 compare equal so both are
+ * hashed as 0.0 to stay consistent with vertexEqual()
+ */
+unsigned int
+vertexHash(Vertex vertex)
+{
+    unsigned int i, bits, h;
+    float data[8];
+
+    memcpy(data, &vertex, sizeof(data));
+    h = 2166136261u;
+    for (i = 0; i < 8; i++) {
+        bits = 0;
+        if (data[i] != 0.0f) memcpy(&bits, data + i, sizeof(bits));
+        h = (h ^ bits) * 16777619u;
+        h ^= h >> 15;
+    }
+    h = (h ^ vertex.material) * 16777619u;
+    return h ^ (h >> 15);
+}
+
+int
+vertexEqual(Vertex v1, Vertex v2)
+{
+    int i;
     for (i = 0; i < 3; i++) {
-        v[vSize].position[i] = vertex.position[i];
-        v[vSize].normal[i]   = vertex.normal[i];
-        if (i < 2)
-            v[vSize].texCoords[i]   = vertex.texCoords[i];
+        if (v1.position[i] != v2.position[i]) return 0;
+        if (v1.normal[i] != v2.normal[i]) return 0;
+    }
+    for (i = 0; i < 2; i++) {
+        if (v1.texCoords[i] != v2.texCoords[i]) return 0;
+    }
+    return v1.material == v2.material;
+}
+
+void
+nameTableInit(struct NameTable *table, unsigned int capacity)
+{
+    table->size = 0;
+    table->capacity = capacity;
+    table->slots = (struct NameSlot *)calloc(capacity, sizeof(struct NameSlot));
+
+    if (table->slots == NULL) {
+        fprintf(stderr, "nameTableInit() Error: %s\n", strerror(errno));
+        exit(1);
     }
-    mesh->vertices = v;
-    mesh->vertexSize++;
 }
 
 void
-indexAdd(Mesh *mesh, int index)
+nameTableGrow(struct NameTable *table)
+{
+    struct NameSlot *slots;
+    const char *name;
+    unsigned int i, j, mask;
+
+    slots = table->slots;
+    mask = table->capacity - 1;
+    nameTableInit(table, 2 * table->capacity);
+
+    for (i = 0; i <= mask; i++) {
+        if (!slots[i].name) continue;
+        name = (const char *)table->chars.data + slots[i].name - 1;
+        j = nameHash(name, name + strlen(name)) & (table->capacity - 1);
+        while (table->slots[j].name)
+            j = (j + 1) & (table->capacity - 1);
+        table->slots[j] = slots[i];
+        table->size++;
+    }
+    free(slots);
+}
+
+/*
+ * Return the slot of the name from name to end, storing it when add is set
+ * and it is not there yet. NULL when it is not there and add is not set
+ */
+struct NameSlot *
+nameTableFind(struct NameTable *table, const char *name, const char *end, int add)
+{
+    struct Array *chars = &table->chars;
+    struct NameSlot *slot;
+    const char *stored;
+    unsigned int i, mask;
+    size_t n = end - name;
+
+    if (add && 2 * (table->size + 1) > table->capacity)
+        nameTableGrow(table);
+
+    mask = table->capacity - 1;
+    for (i = nameHash(name, end) & mask; table->slots[i].name; i = (i + 1) & mask) {
+        stored = (const char *)chars->data + table->slots[i].name - 1;
+        if (!memcmp(stored, name, n) && stored[n] == '\0')
+            return table->slots + i;
+    }
+    if (!add) return NULL;
+
+    if (chars->size + n + 1 > chars->capacity)
+        arrayReserve(chars, 2 * (chars->size + n + 1));
+    memcpy((char *)chars->data + chars->size, name, n);
+    ((char *)chars->data)[chars->size + n] = '\0';
+
+    slot = table->slots + i;
+    slot->name = chars->size + 1;
+    slot->material = slot->lib = 0;
+    chars->size += n + 1;
+    table->size++;
+    return slot;
+}
+
+unsigned int
+nameHash(const char *name, const char *end)
 {
-    unsigned int *iv, iSize;
+    unsigned int h = 2166136261u;
+    while (name < end) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
 
-    iv = mesh->indices;
-    iSize = mesh->indexSize;
+/*
+ * Path of the mtl file a mtllib line of objFile names with the size bytes
+ * at name, it is relative to the directory of objFile
+ */
+char *
+objMtlPath(const char *objFile, const char *name, size_t size)
+{
+    char *path, *dir;
 
-    if (!iSize) iv = (unsigned int *)calloc(1, sizeof(int));
-    else        iv = (unsigned int *)realloc(iv, (iSize + 1) * sizeof(int));
+    if (size > 2 && !strncmp(name, "./", 2)) {
+        name += 2;
+        size -= 2;
+    }
 
-    if (iv == NULL) {
-        fprintf(stderr, "vertexAdd() Error: %s\n", strerror(errno));
+    dir = (char *)malloc(strlen(objFile) + 2);
+    path = (char *)malloc(strlen(objFile) + size + 3);
+    if (dir == NULL || path == NULL) {
+        perror("objMtlPath() Error");
         exit(1);
     }
 
-    iv[iSize] = index;
-    mesh->indices = iv;
-    mesh->indexSize++;
+    strcpy(dir, objFile);
+    getDir(dir);
+    sprintf(path, "%s/%.*s", dir, (int)size, name);
+    free(dir);
+    return path;
 }
 
+/*
+ * Read the materials of the mtl file named in line, next to objFile, and
+ * intern their names in names
+ */
 Material *
-readMtl(char *line, const char *objFile, int *size)
+readMtl(const char *line, const char *end, const char *objFile, struct NameTable *names, int *size)
 {
     Material *out;
-    char buffer[OBJ_LINE_MAX], mtlFilename[OBJ_LINE_MAX], key[OBJ_MAX_WORD];
-    char path[OBJ_MAX_WORD], fileName[OBJ_MAX_WORD];
-    FILE *fin;
-    int i, n;
-
-    strncpy(path, objFile, 512);
-    getDir(path);
-    sscanf(line, " ./%s", fileName);
-    sprintf(mtlFilename, "%s/%s", path, fileName);
-
-    fin = fopen(mtlFilename, "r");
-
-    if (fin == NULL && errno == ENOENT) {
+    struct Array mtl;
+    struct Source src;
+    const char *name, *nameEnd, *ptr, *srcEnd, *key, *lineEnd;
+    char *mtlFilename;
+    int i, ret, illum;
+
+    name = skipSpace(line, end);
+    nameEnd = skipWord(name, end);
+    mtlFilename = objMtlPath(objFile, name, nameEnd - name);
+
+    ret = sourceOpen(&src, mtlFilename);
+    if (ret && errno == ENOENT) {
         perror("readMtl() Warning");
+        free(mtlFilename);
         if (size) *size = 0;
         return NULL;
-    } else if (fin == NULL) {
+    } else if (ret) {
         perror("readMtl() Error");
         exit(1);
     }
 
-    i = 0;
-    while(fgets(buffer, OBJ_LINE_MAX, fin)) {
-        sscanf(buffer, "%s%n", key, &n);
-        if  (!strcmp(key, "newmtl")) appendMtl(buffer + n, &out, i++);
-        if (i > 0) {
-            if      (!strcmp(key, "Ka"))     readColor(buffer + n, out[i - 1].ka);
-            else if (!strcmp(key, "Kd"))     readColor(buffer + n, out[i - 1].kd);
-            else if (!strcmp(key, "Ks"))     readColor(buffer + n, out[i - 1].ks);
-            else if (!strcmp(key, "illum"))  sscanf(buffer + n, "%u", &out[i - 1].illum);
-            else if (!strcmp(key, "Ns"))     sscanf(buffer + n, "%f", &out[i - 1].ns);
+    arrayInit(&mtl, sizeof(Material), 0);
+    ptr = src.data;
+    srcEnd = src.data + src.size;
+    while (nextLine(&ptr, srcEnd, &key, &lineEnd)) {
+        key = skipSpace(key, lineEnd);
+        line = skipWord(key, lineEnd);
+        if  (wordIs(key, line, "newmtl")) appendMtl(line, lineEnd, &mtl, names);
+        if ((i = mtl.size) > 0) {
+            out = (Material *)mtl.data;
+            if      (wordIs(key, line, "Ka"))     readColor(line, lineEnd, out[i - 1].ka);
+            else if (wordIs(key, line, "Kd"))     readColor(line, lineEnd, out[i - 1].kd);
+            else if (wordIs(key, line, "Ks"))     readColor(line, lineEnd, out[i - 1].ks);
+            else if (wordIs(key, line, "Ns"))     readFloats(line, lineEnd, &out[i - 1].ns, 1);
+            else if (wordIs(key, line, "illum")) {
+                if (parseInt(skipSpace(line, lineEnd), lineEnd, &illum) != NULL)
+                    out[i - 1].illum = illum;
+            }
         }
-        key[0] = '\0';
     }
 
-    if (size) *size = i;
-    fclose(fin);
-    return out;
+    if (size) *size = mtl.size;
+    free(mtlFilename);
+    sourceClose(&src);
+    return (Material *)arrayRelease(&mtl);
 }
 
 void
-appendMtl(char *line, Material **mtl, int index)
+appendMtl(const char *line, const char *end, struct Array *mtl, struct NameTable *names)
 {
-    char name[OBJ_LINE_MAX];
-
-    if (index == 0)
-        *mtl = (Material *)calloc(1, sizeof(Material));
-    else {
-        *mtl = (Material *)realloc(*mtl, (index + 1) * sizeof(Material));
-        memset(*mtl + index, 0, sizeof(Material));
-    }
-
-    sscanf(line, "%s", name);
-    strncpy((*mtl + index)->name, name, OBJ_LINE_MAX);
+    Material *out;
+    const char *name;
 
-    if (mtl == NULL) {
-        perror("appendMtl() Error");
-        exit(1);
-    }
+    out = (Material *)arrayAppend(mtl);
+    name = skipSpace(line, end);
+    out->name = nameTableFind(names, name, skipWord(name, end), 1)->name - 1;
 }
 
 void
-readColor(char *line, float *k)
+readColor(const char *line, const char *end, float *k)
 {
     int ret;
-    ret = sscanf(line, "%f %f %f", k, k + 1, k + 2);
+    ret = readFloats(line, end, k, 3);
     switch (ret) {
         case 1:
             k[1] = k[2] = k[0];
@@ -430,23 +1118,333 @@ readColor(char *line, float *k)
         case 3:
             break;
         default:
-            fprintf(stderr, "readColor() Error: line '%s' invalid format", line - 2);
+            fprintf(stderr, "readColor() Error: line '%.*s' invalid format\n", (int)(end - line), line);
             exit(1);
             break;
     }
 }
 
+/*
+ * Return the material of the last mtllib named in line, fallback when it
+ * defines none of that name
+ */
 unsigned int
-useMtl(char *line, Material *mtl, unsigned int size)
+useMtl(const char *line, const char *end, struct NameTable *names, unsigned int fallback)
+{
+    struct NameSlot *slot;
+    const char *name;
+
+    name = skipSpace(line, end);
+    slot = nameTableFind(names, name, skipWord(name, end), 0);
+    return (slot && slot->lib == names->lib) ? slot->material : fallback;
+}
+
+/*
+ * Map filename into memory, "-" and anything that can't be mapped is read
+ * through stdio instead. Return 0 on success and -1 with errno set
+ */
+int
+sourceOpen(struct Source *src, const char *filename)
+{
+    struct stat st;
+    FILE *fi;
+    int fd, ret;
+
+    src->data = NULL;
+    src->size = 0;
+    src->mapped = 0;
+
+    if (!strcmp(filename, "-"))
+        return sourceRead(src, stdin);
+
+    if ((fd = open(filename, O_RDONLY)) == -1)
+        return -1;
+
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+        src->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (src->data != MAP_FAILED) {
+            posix_madvise(src->data, st.st_size, POSIX_MADV_SEQUENTIAL);
+            src->size = st.st_size;
+            src->mapped = 1;
+            close(fd);
+            return 0;
+        }
+        src->data = NULL;
+    }
+
+    if ((fi = fdopen(fd, "r")) == NULL) {
+        close(fd);
+        return -1;
+    }
+    ret = sourceRead(src, fi);
+    fclose(fi);
+    return ret;
+}
+
+int
+sourceRead(struct Source *src, FILE *fi)
+{
+    size_t capacity, n;
+    char *data;
+
+    capacity = 1 << 16;
+    src->data = (char *)malloc(capacity);
+
+    while (src->data != NULL) {
+        n = fread(src->data + src->size, 1, capacity - src->size, fi);
+        src->size += n;
+        if (src->size < capacity) break;
+
+        capacity *= 2;
+        data = (char *)realloc(src->data, capacity);
+        if (data == NULL) free(src->data);
+        src->data = data;
+    }
+    return (src->data == NULL || ferror(fi)) ? -1 : 0;
+}
+
+void
+sourceClose(struct Source *src)
+{
+    if (src->mapped) munmap(src->data, src->size);
+    else             free(src->data);
+    src->data = NULL;
+    src->size = 0;
+}
+
+/*
+ * Point line at the next line in [*ptr, end) and lineEnd at its newline,
+ * return 0 once there are no more lines
+ */
+int
+nextLine(const char **ptr, const char *end, const char **line, const char **lineEnd)
+{
+    const char *newline;
+
+    if (*ptr >= end) return 0;
+
+    newline = (const char *)memchr(*ptr, '\n', end - *ptr);
+    *line = *ptr;
+    *lineEnd = (newline) ? newline : end;
+    *ptr = (newline) ? newline + 1 : end;
+    return 1;
+}
+
+int
+isBlank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+const char *
+skipSpace(const char *ptr, const char *end)
+{
+    while (ptr < end && isBlank(*ptr)) ptr++;
+    return ptr;
+}
+
+const char *
+skipWord(const char *ptr, const char *end)
+{
+    while (ptr < end && !isBlank(*ptr)) ptr++;
+    return ptr;
+}
+
+/*
+ * Compare the word [word, end) against the NUL terminated str
+ */
+int
+wordIs(const char *word, const char *end, const char *str)
+{
+    size_t n = strlen(str);
+    return (size_t)(end - word) == n && !memcmp(word, str, n);
+}
+
+/*
+ * Copy the word at ptr into a NUL terminated buffer of the given size,
+ * truncating it if needed, and return a pointer past the word
+ */
+const char *
+copyWord(const char *ptr, const char *end, char *word, size_t size)
+{
+    const char *wordEnd = skipWord(ptr, end);
+    size_t n = wordEnd - ptr;
+
+    if (n >= size) n = size - 1;
+    memcpy(word, ptr, n);
+    word[n] = '\0';
+    return wordEnd;
+}
+
+/*
+ * Read up to n blank separated floats, return how many were read
+ */
+int
+readFloats(const char *ptr, const char *end, float *k, int n)
 {
     int i;
-    char name[OBJ_LINE_MAX];
-    for (i = 0; i < size; i++) {
-        sscanf(line, "%s", name);
-        if (!strcmp(name, mtl[i].name))
-            return i;
+
+    for (i = 0; i < n; i++) {
+        ptr = parseFloat(skipSpace(ptr, end), end, k + i);
+        if (ptr == NULL) break;
+    }
+    return i;
+}
+
+/*
+ * Parse the decimal number at ptr into out with the same result strtof()
+ * gives. When the digits fit in 53 bits and the exponent is within 22 the
+ * value is computed exactly in double precision and rounded once to float,
+ * anything else (and the rare double landing on a float rounding boundary)
+ * goes through strtof(). Return a pointer past the number or NULL when
+ * there is no number at ptr
+ */
+const char *
+parseFloat(const char *ptr, const char *end, float *out)
+{
+    static const double pow10[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const uint64_t mMax = UINT64_C(100000000000000000);
+    const char *start = ptr, *digits;
+    char word[OBJ_MAX_WORD], *wordEnd;
+    uint64_t m, bits;
+    int negative, exponent, e, eNegative, nDigits, exact;
+    double d;
+
+    negative = 0;
+    if (ptr < end && (*ptr == '-' || *ptr == '+')) negative = (*ptr++ == '-');
+
+    m = 0;
+    exponent = 0;
+    exact = 1;
+
+    for (digits = ptr; ptr < end && isDigit(*ptr); ptr++) {
+        if (m < mMax) {
+            m = 10 * m + (*ptr - '0');
+        } else {
+            exponent++;
+            if (*ptr != '0') exact = 0;
+        }
+    }
+    nDigits = ptr - digits;
+
+    if (ptr < end && *ptr == '.') {
+        ptr++;
+        for (digits = ptr; end - ptr >= 8 && m < mMax / 1000000 && isEightDigits(ptr); ptr += 8) {
+            m = 100000000 * m + parseEightDigits(ptr);
+            exponent -= 8;
+        }
+        for (; ptr < end && isDigit(*ptr); ptr++) {
+            if (m < mMax) {
+                m = 10 * m + (*ptr - '0');
+                exponent--;
+            } else if (*ptr != '0') {
+                exact = 0;
+            }
+        }
+        nDigits += ptr - digits;
+    }
+
+    if (ptr < end && (*ptr == 'e' || *ptr == 'E') && nDigits) {
+        digits = ptr + 1;
+        eNegative = 0;
+        if (digits < end && (*digits == '-' || *digits == '+'))
+            eNegative = (*digits++ == '-');
+        if (digits < end && isDigit(*digits)) {
+            for (e = 0, ptr = digits; ptr < end && isDigit(*ptr); ptr++)
+                if (e < 10000) e = 10 * e + (*ptr - '0');
+            exponent += (eNegative) ? -e : e;
+        }
+    }
+
+    /* No digits (inf, nan) or something unusual right after the number */
+    if (!nDigits || (ptr < end && !isBlank(*ptr))) exact = 0;
+
+    if (exact && m == 0) {
+        *out = (negative) ? -0.0f : 0.0f;
+        return ptr;
+    }
+
+    if (exact && m <= (UINT64_C(1) << 53) && exponent >= -22 && exponent <= 22) {
+        d = (double)m;
+        d = (exponent < 0) ? d / pow10[-exponent] : d * pow10[exponent];
+
+        /*
+         * d is correctly rounded, so rounding it again to float only goes
+         * wrong when it sits exactly halfway between two floats, that is
+         * when the 29 mantissa bits float drops are 1 followed by zeros
+         */
+        memcpy(&bits, &d, sizeof(bits));
+        if (d >= FLT_MIN && d <= FLT_MAX
+            && (bits & ((UINT64_C(1) << 29) - 1)) != (UINT64_C(1) << 28)) {
+            *out = (negative) ? -(float)d : (float)d;
+            return ptr;
+        }
     }
+
+    copyWord(start, end, word, sizeof(word));
+    *out = strtof(word, &wordEnd);
+    return (wordEnd == word) ? NULL : start + (wordEnd - word);
+}
+
+/*
+ * Parse the decimal integer at ptr into out, saturating on overflow.
+ * Return a pointer past it or NULL when there is no integer at ptr
+ */
+const char *
+parseInt(const char *ptr, const char *end, int *out)
+{
+    const char *digits;
+    long value;
+    int negative;
+
+    negative = 0;
+    if (ptr < end && (*ptr == '-' || *ptr == '+')) negative = (*ptr++ == '-');
+
+    for (value = 0, digits = ptr; ptr < end && isDigit(*ptr); ptr++)
+        if (value <= INT_MAX) value = 10 * value + (*ptr - '0');
+
+    if (ptr == digits) return NULL;
+
+    if (value > INT_MAX) value = INT_MAX;
+    *out = (negative) ? -value : value;
+    return ptr;
+}
+
+int
+isDigit(char c)
+{
+    return (unsigned char)(c - '0') < 10;
+}
+
+/*
+ * SWAR helpers, check and convert eight ASCII digits at once by loading
+ * them as a little endian 64 bit word
+ */
+int
+isEightDigits(const char *ptr)
+{
+    uint64_t val;
+    memcpy(&val, ptr, sizeof(val));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return ((val & UINT64_C(0xF0F0F0F0F0F0F0F0))
+            | (((val + UINT64_C(0x0606060606060606)) & UINT64_C(0xF0F0F0F0F0F0F0F0)) >> 4))
+            == UINT64_C(0x3333333333333333);
+#else
     return 0;
+#endif
+}
+
+uint32_t
+parseEightDigits(const char *ptr)
+{
+    uint64_t val;
+    memcpy(&val, ptr, sizeof(val));
+    val = (val & UINT64_C(0x0F0F0F0F0F0F0F0F)) * 2561 >> 8;
+    val = (val & UINT64_C(0x00FF00FF00FF00FF)) * 6553601 >> 16;
+    return (uint32_t)((val & UINT64_C(0x0000FFFF0000FFFF)) * UINT64_C(42949672960001) >> 32);
 }
 
 void
@@ -19,13 +19,18 @@
 # ifndef __OBJ__
 #define __OBJ__
 
-#define OBJ_LINE_MAX 1024
+#include <stddef.h>
+
 #define OBJ_MAX_WORD 512
+#define OBJ_HINT_BYTES 128
+#define OBJ_CHUNK_MIN (1 << 20)
+#define OBJ_LOD_LEVELS 5    /* full detail and 4 coarser levels */
 
 typedef struct {
     float position[3];
     float normal[3];
     float texCoords[2];
+    unsigned int material;  /* position in the Obj material table */
 } Vertex;
 
 typedef struct {
@@ -34,24 +39,100 @@ typedef struct {
 } Texture;
 
 typedef struct {
-    char name[OBJ_LINE_MAX];
+    unsigned int name;      /* offset of its name in the Obj names */
     float ka[3], kd[3], ks[3];
     unsigned int illum;
     float ns;
 } Material;
 
+/*
+ * Sub-mesh drawn with one material, a range of its Obj index buffer
+ */
+typedef struct {
+    unsigned int material;
+    unsigned int indexOffset, indexSize;
+    float min[3], max[3];       /* box of its vertices */
+    float center[3], radius;    /* sphere around the box centre */
+} Mesh;
+
+/*
+ * Bounding sphere and normal cone of a group of triangles, a cutoff above
+ * 1 means they face too many ways for the cone to cull anything
+ */
+typedef struct {
+    float center[3], radius;
+    float axis[3], cutoff;
+} Bounds;
+
+/*
+ * Cluster of consecutive triangles of one mesh
+ */
+typedef struct {
+    unsigned int mesh;
+    unsigned int indexOffset, indexSize;
+    Bounds bounds;
+} Meshlet;
+
+/*
+ * Detail levels of a mesh, level 0 is the mesh range of the Obj indices
+ * and every other level halves the triangles of the one before. error is
+ * the largest distance the simplification moved the surface
+ */
+typedef struct {
+    unsigned int indexOffset[OBJ_LOD_LEVELS], indexSize[OBJ_LOD_LEVELS];
+    float error[OBJ_LOD_LEVELS];
+    unsigned int level;     /* picked for the current frame */
+} MeshLod;
+
+/*
+ * glMultiDrawElementsBaseVertex() arguments, the 16 bit draws go first
+ */
+typedef struct {
+    int *count, *base;
+    void **offset;
+    unsigned int size, shortSize;
+} DrawList;
+
+/*
+ * Every mesh shares the vertex and index buffers and the GL objects. The
+ * first material is the default one used before any usemtl line
+ */
 typedef struct {
     Vertex *vertices;
-    Material material;
     unsigned int *indices;
-    unsigned int indexSize, vertexSize;
+    unsigned int vertexSize, indexSize;
     unsigned int VAO, EBO, VBO;
-} Mesh;
+    float unpackOffset[3], unpackScale[3];   /* maps the VBO positions to the model */
+
+    Material *material;
+    unsigned int materialSize;
+    char *names;            /* material names, each NUL terminated */
+    unsigned int nameSize;
+    char *libraries;        /* mtllib files read, each NUL terminated */
+    unsigned int librarySize;
+    unsigned int materialTBO, materialTexture;
 
-typedef struct {
     Mesh *mesh;
     unsigned int size;
+
+    Meshlet *meshlet;    /* NULL unless built, then the draws are meshlets */
+    unsigned int meshletSize;
+
+    MeshLod *lod;        /* NULL unless built, one per mesh */
+    unsigned int *lodIndices;
+    unsigned int lodIndexSize;
+
+    DrawList draws, visible;
+    unsigned int *drawSource, *drawLevel;    /* meshlet or mesh, and level */
+    unsigned char *meshVisible;              /* meshes in the current frustum */
+    unsigned char *meshResident;             /* meshes whose data is in the GL buffers */
+
+    void *cache;         /* mapped cache file the buffers point into, or NULL */
+    size_t cacheSize;
 } Obj;
 
-Obj objCreate(const char *filename);
+Obj objCreate(const char *filename, int nThreads);
+void objMerge(Obj *obj);
+char * objMtlPath(const char *objFile, const char *name, size_t size);
+void objDestroy(Obj *obj);
 # endif
@@ -0,0 +1,613 @@
+/*
+ * This file is part of mverse
+ * Copyright (C) 2022  juanvalencia.xyz
+
+ * mverse is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <pthread.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "occlude.h"
+
+#define LEVEL_WIDTH(l) ((OCCLUDE_WIDTH >> (l)) ? OCCLUDE_WIDTH >> (l) : 1)
+#define LEVEL_HEIGHT(l) ((OCCLUDE_HEIGHT >> (l)) ? OCCLUDE_HEIGHT >> (l) : 1)
+
+/*
+ * Mesh that may hide others and how big it looks from the eye
+ */
+struct OccludeCandidate {
+    float size;
+    unsigned int mesh;
+};
+
+/*
+ * Indices of an occluder in obj->indices
+ */
+struct OccludeRange {
+    unsigned int offset, count;
+};
+
+/*
+ * Workers started by occludeCreate() wait on start for a new generation,
+ * run work on their state and signal done when the last one finishes
+ */
+struct OccludePool {
+    pthread_mutex_t lock;
+    pthread_cond_t start, done;
+    void *(*work)(void *);
+    unsigned int generation;
+    int pending, quit;
+};
+
+/*
+ * A thread first clips a share of the occluder triangles into screen, x
+ * and y in texels and depth for each corner, then fills a band of rows
+ * with the triangles of every thread
+ */
+struct OccludeThread {
+    Occlusion *o;
+    const Obj *obj;
+    struct OccludePool *pool;
+    pthread_t thread;
+    unsigned int index, size, capacity;
+    float (*screen)[9];
+};
+
+static void occludeSelect(Occlusion *o, const Obj *obj, const Frustum *frustum);
+static void occludeRun(Occlusion *o, void *(*work)(void *));
+static void * occludeWorker(void *thread);
+static void * occludeSetUp(void *thread);
+static void * occludeFill(void *thread);
+static void occludeClip(struct OccludeThread *t, float (*v)[4]);
+static void occludeTriangle(float *depth, const float *v, int y0, int y1);
+static void occludeSpan(float *row, int xa, int xb, float z, float a);
+static void occludePyramid(Occlusion *o);
+static int candidateCompare(const void *a, const void *b);
+
+/*
+ * Allocate the buffer and the state of nThreads threads for obj, 0 uses
+ * one per CPU
+ */
+Occlusion
+occludeCreate(const Obj *obj, int nThreads)
+{
+    Occlusion o;
+    unsigned int l, size;
+    int i;
+
+    memset(&o, 0, sizeof(o));
+    if (nThreads <= 0) nThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nThreads > OCCLUDE_HEIGHT) nThreads = OCCLUDE_HEIGHT;
+    o.nThreads = nThreads;
+
+    for (l = size = 0; l < OCCLUDE_LEVELS; l++)
+        size += LEVEL_WIDTH(l) * LEVEL_HEIGHT(l);
+
+    o.level[0] = (float *)malloc(size * sizeof(float));
+    o.candidates = (struct OccludeCandidate *)malloc((obj->size + 1) * sizeof(struct OccludeCandidate));
+    o.ranges = (struct OccludeRange *)malloc((obj->size + 1) * sizeof(struct OccludeRange));
+    o.threads = (struct OccludeThread *)calloc(nThreads, sizeof(struct OccludeThread));
+    if (o.level[0] == NULL || o.candidates == NULL || o.ranges == NULL || o.threads == NULL) {
+        perror("occludeCreate() Error");
+        exit(1);
+    }
+
+    for (l = 1; l < OCCLUDE_LEVELS; l++)
+        o.level[l] = o.level[l - 1] + LEVEL_WIDTH(l - 1) * LEVEL_HEIGHT(l - 1);
+    for (l = 0; l < size; l++)
+        o.level[0][l] = INFINITY;
+    for (i = 0; i < nThreads; i++)
+        o.threads[i].index = i;
+    if (nThreads == 1) return o;
+
+    /* The calling thread does the share of the first state */
+    o.pool = (struct OccludePool *)calloc(1, sizeof(struct OccludePool));
+    if (o.pool == NULL || pthread_mutex_init(&o.pool->lock, NULL)
+        || pthread_cond_init(&o.pool->start, NULL) || pthread_cond_init(&o.pool->done, NULL)) {
+        perror("occludeCreate() Error");
+        exit(1);
+    }
+    for (i = 1; i < nThreads; i++) {
+        o.threads[i].pool = o.pool;
+        if (pthread_create(&o.threads[i].thread, NULL, occludeWorker, o.threads + i)) {
+            perror("occludeCreate() Error");
+            exit(1);
+        }
+    }
+    return o;
+}
+
+/*
+ * Draw the biggest meshes obj->meshVisible holds that fit in
+ * OCCLUDE_TRIANGLES into the depth buffer, and build the pyramid over it
+ */
+void
+occludeRender(Occlusion *o, const Obj *obj, const Frustum *frustum)
+{
+    int i;
+
+    o->clip = frustum->clip;
+    occludeSelect(o, obj, frustum);
+    for (i = 0; i < o->nThreads; i++) {
+        o->threads[i].o = o;
+        o->threads[i].obj = obj;
+    }
+
+    occludeRun(o, occludeSetUp);
+    occludeRun(o, occludeFill);
+    occludePyramid(o);
+}
+
+/*
+ * Return 1 when the box is behind the depth buffer everywhere it covers.
+ * Boxes crossing the near plane are never hidden
+ */
+int
+occludeBox(const Occlusion *o, const float *min, const float *max)
+{
+    const float (*m)[4] = o->clip.matrix;
+    const float *depth;
+    float p[3], c[4], lo[3], hi[3];
+    int i, j, l, x0, x1, y0, y1, x, y, width;
+
+    for (j = 0; j < 3; j++) {
+        lo[j] = INFINITY;
+        hi[j] = -INFINITY;
+    }
+    for (i = 0; i < 8; i++) {
+        for (j = 0; j < 3; j++)
+            p[j] = (i >> j & 1) ? max[j] : min[j];
+        for (j = 0; j < 4; j++)
+            c[j] = m[j][0] * p[0] + m[j][1] * p[1] + m[j][2] * p[2] + m[j][3];
+        if (c[3] <= 0 || c[2] < -c[3]) return 0;
+
+        for (j = 0; j < 3; j++) {
+            if (c[j] / c[3] < lo[j]) lo[j] = c[j] / c[3];
+            if (c[j] / c[3] > hi[j]) hi[j] = c[j] / c[3];
+        }
+    }
+    if (hi[0] < -1 || lo[0] > 1 || hi[1] < -1 || lo[1] > 1) return 0;
+
+    /* Every texel holds a depth its whole square is behind */
+    x0 = (int)floorf((lo[0] * 0.5f + 0.5f) * OCCLUDE_WIDTH);
+    x1 = (int)floorf((hi[0] * 0.5f + 0.5f) * OCCLUDE_WIDTH);
+    y0 = (int)floorf((lo[1] * 0.5f + 0.5f) * OCCLUDE_HEIGHT);
+    y1 = (int)floorf((hi[1] * 0.5f + 0.5f) * OCCLUDE_HEIGHT);
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 > OCCLUDE_WIDTH - 1) x1 = OCCLUDE_WIDTH - 1;
+    if (y1 > OCCLUDE_HEIGHT - 1) y1 = OCCLUDE_HEIGHT - 1;
+
+    /* The level where the box covers at most 2 x 2 texels */
+    for (l = 0; l + 1 < OCCLUDE_LEVELS && ((x1 >> l) - (x0 >> l) > 1 || (y1 >> l) - (y0 >> l) > 1); l++);
+
+    depth = o->level[l];
+    width = LEVEL_WIDTH(l);
+    for (y = y0 >> l; y <= y1 >> l; y++)
+        for (x = x0 >> l; x <= x1 >> l; x++)
+            if (depth[y * width + x] >= lo[2]) return 0;
+    return 1;
+}
+
+/*
+ * occludeBox() on the box around the sphere
+ */
+int
+occludeSphere(const Occlusion *o, const float *center, float radius)
+{
+    float min[3], max[3];
+    int j;
+
+    for (j = 0; j < 3; j++) {
+        min[j] = center[j] - radius;
+        max[j] = center[j] + radius;
+    }
+    return occludeBox(o, min, max);
+}
+
+void
+occludeFree(Occlusion *o)
+{
+    int i;
+
+    if (o->pool) {
+        pthread_mutex_lock(&o->pool->lock);
+        o->pool->quit = 1;
+        pthread_cond_broadcast(&o->pool->start);
+        pthread_mutex_unlock(&o->pool->lock);
+        for (i = 1; i < o->nThreads; i++)
+            pthread_join(o->threads[i].thread, NULL);
+        pthread_cond_destroy(&o->pool->start);
+        pthread_cond_destroy(&o->pool->done);
+        pthread_mutex_destroy(&o->pool->lock);
+        free(o->pool);
+    }
+    for (i = 0; i < o->nThreads; i++)
+        free(o->threads[i].screen);
+    free(o->threads);
+    free(o->level[0]);
+    free(o->candidates);
+    free(o->ranges);
+    memset(o, 0, sizeof(*o));
+}
+
+/*
+ * Fill o->ranges with the meshes bigger than OCCLUDE_SIZE, biggest first,
+ * that fit in OCCLUDE_TRIANGLES. Only their full detail is drawn, the
+ * coarser levels may bulge out of the surface and hide what is in front
+ */
+void
+occludeSelect(Occlusion *o, const Obj *obj, const Frustum *frustum)
+{
+    struct OccludeCandidate *c = o->candidates;
+    struct OccludeRange *r;
+    const Mesh *mesh;
+    unsigned int i, j, size;
+    float d, distance;
+
+    for (i = size = 0; i < obj->size; i++) {
+        mesh = obj->mesh + i;
+        if (!mesh->indexSize || !obj->meshVisible[i]) continue;
+
+        for (j = 0, distance = 0; j < 3; j++) {
+            d = mesh->center[j] - frustum->eye.vector[j];
+            distance += d * d;
+        }
+        distance = sqrtf(distance);
+        c[size].size = (distance > mesh->radius) ? mesh->radius / distance : INFINITY;
+        c[size].mesh = i;
+        if (c[size].size >= OCCLUDE_SIZE) size++;
+    }
+    qsort(c, size, sizeof(struct OccludeCandidate), candidateCompare);
+
+    o->rangeSize = o->triangles = 0;
+    for (i = 0; i < size; i++) {
+        r = o->ranges + o->rangeSize;
+        mesh = obj->mesh + c[i].mesh;
+        r->offset = mesh->indexOffset;
+        r->count = mesh->indexSize;
+        if (o->triangles + r->count / 3 > OCCLUDE_TRIANGLES) continue;
+        o->triangles += r->count / 3;
+        o->rangeSize++;
+    }
+}
+
+/*
+ * Call work on every thread state, the first one on this thread and the
+ * rest on the workers, and wait for all of them
+ */
+void
+occludeRun(Occlusion *o, void *(*work)(void *))
+{
+    struct OccludePool *pool = o->pool;
+
+    if (pool == NULL) {
+        work(o->threads);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->work = work;
+    pool->pending = o->nThreads - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    work(o->threads);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Run the work of every new generation on the thread state until
+ * occludeFree() sets quit
+ */
+void *
+occludeWorker(void *thread)
+{
+    struct OccludeThread *t = (struct OccludeThread *)thread;
+    struct OccludePool *pool = t->pool;
+    void *(*work)(void *);
+    unsigned int generation = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->generation == generation && !pool->quit)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->quit) break;
+        generation = pool->generation;
+        work = pool->work;
+        pthread_mutex_unlock(&pool->lock);
+
+        work(t);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0) pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/*
+ * Take the share of occluder triangles of the thread to clip space and
+ * clip them into its screen triangles
+ */
+void *
+occludeSetUp(void *thread)
+{
+    struct OccludeThread *t = (struct OccludeThread *)thread;
+    const Occlusion *o = t->o;
+    const struct OccludeRange *r;
+    const float (*m)[4] = o->clip.matrix;
+    const float *p;
+    float v[8][4];
+    unsigned int first, end, base, k, i, j;
+
+    first = (unsigned long)o->triangles * t->index / o->nThreads;
+    end = (unsigned long)o->triangles * (t->index + 1) / o->nThreads;
+    t->size = 0;
+
+    for (r = o->ranges, base = 0; r < o->ranges + o->rangeSize && first < end; base += r->count / 3, r++) {
+        for (k = first - base; k < r->count / 3 && first < end; k++, first++) {
+            for (i = 0; i < 3; i++) {
+                p = t->obj->vertices[t->obj->indices[r->offset + 3 * k + i]].position;
+                for (j = 0; j < 4; j++)
+                    v[i][j] = m[j][0] * p[0] + m[j][1] * p[1] + m[j][2] * p[2] + m[j][3];
+            }
+            occludeClip(t, v);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Clear the band of rows of the thread and draw every screen triangle
+ * over it
+ */
+void *
+occludeFill(void *thread)
+{
+    struct OccludeThread *t = (struct OccludeThread *)thread;
+    const Occlusion *o = t->o;
+    unsigned int i, k;
+    int y0, y1, x;
+
+    y0 = OCCLUDE_HEIGHT * t->index / o->nThreads;
+    y1 = OCCLUDE_HEIGHT * (t->index + 1) / o->nThreads;
+    for (x = y0 * OCCLUDE_WIDTH; x < y1 * OCCLUDE_WIDTH; x++)
+        o->level[0][x] = INFINITY;
+
+    for (i = 0; i < (unsigned int)o->nThreads; i++)
+        for (k = 0; k < o->threads[i].size; k++)
+            occludeTriangle(o->level[0], o->threads[i].screen[k], y0, y1);
+    return NULL;
+}
+
+/*
+ * Clip the clip space triangle in v, which has room for 8 corners, to the
+ * near and side planes and append the fan of the polygon left to the
+ * screen triangles of t
+ */
+void
+occludeClip(struct OccludeThread *t, float (*v)[4])
+{
+    /* Plane k keeps w + sign[k] * v[axis[k]] >= 0 */
+    static const int axis[5] = {2, 0, 0, 1, 1}, sign[5] = {1, 1, -1, 1, -1};
+    float other[8][4], (*src)[4] = v, (*dst)[4] = other, (*swap)[4], d[8], s, *out;
+    unsigned int size, next, i, j, k, all, any, code;
+
+    all = 0x1f;
+    any = 0;
+    for (i = 0; i < 3; i++) {
+        for (k = code = 0; k < 5; k++)
+            if (v[i][3] + sign[k] * v[i][axis[k]] < 0) code |= 1u << k;
+        all &= code;
+        any |= code;
+    }
+    if (all) return;
+
+    for (k = 0, size = 3; k < 5 && size >= 3 && any; k++) {
+        if (!(any & 1u << k)) continue;
+        for (i = 0; i < size; i++)
+            d[i] = src[i][3] + sign[k] * src[i][axis[k]];
+
+        for (i = next = 0; i < size; i++) {
+            j = (i + 1) % size;
+            if (d[i] >= 0)
+                memcpy(dst[next++], src[i], sizeof(src[i]));
+            if ((d[i] >= 0) != (d[j] >= 0)) {
+                s = d[i] / (d[i] - d[j]);
+                for (code = 0; code < 4; code++)
+                    dst[next][code] = src[i][code] + s * (src[j][code] - src[i][code]);
+                next++;
+            }
+        }
+        size = next;
+        swap = src;
+        src = dst;
+        dst = swap;
+    }
+
+    for (i = 0; i < size; i++) {
+        s = 1 / src[i][3];
+        src[i][0] = (src[i][0] * s * 0.5f + 0.5f) * OCCLUDE_WIDTH;
+        src[i][1] = (src[i][1] * s * 0.5f + 0.5f) * OCCLUDE_HEIGHT;
+        src[i][2] *= s;
+    }
+
+    for (i = 1; i + 1 < size; i++) {
+        if (t->size == t->capacity) {
+            t->capacity = (t->capacity) ? 2 * t->capacity : 1024;
+            t->screen = (float (*)[9])realloc(t->screen, t->capacity * sizeof(t->screen[0]));
+            if (t->screen == NULL) {
+                perror("occludeClip() Error");
+                exit(1);
+            }
+        }
+        out = t->screen[t->size++];
+        memcpy(out, src[0], 3 * sizeof(float));
+        memcpy(out + 3, src[i], 3 * sizeof(float));
+        memcpy(out + 6, src[i + 1], 3 * sizeof(float));
+    }
+}
+
+/*
+ * Draw the rows y0 to y1 - 1 of the screen triangle v, the texels whose
+ * whole square it covers keep the farthest depth the triangle plane
+ * reaches over them when that is nearer than what they hold. Texels it
+ * only partly covers are left alone, so nothing behind a crack between
+ * occluders is ever hidden. Every row is one span
+ */
+void
+occludeTriangle(float *depth, const float *v, int y0, int y1)
+{
+    float dx1, dy1, dz1, dx2, dy2, dz2, area, a, b, c, lo, hi, py, x, z, slope[3], *row;
+    int xa, xb, ya, yb, y, i, j, side[3];
+
+    lo = hi = v[1];
+    for (i = 4; i < 9; i += 3) {
+        if (v[i] < lo) lo = v[i];
+        if (v[i] > hi) hi = v[i];
+    }
+    ya = (lo > y0) ? (int)ceilf(lo) : y0;
+    yb = (hi - 1 < y1 - 1) ? (int)floorf(hi) - 1 : y1 - 1;
+    if (ya > yb) return;
+
+    dx1 = v[3] - v[0];
+    dy1 = v[4] - v[1];
+    dz1 = v[5] - v[2];
+    dx2 = v[6] - v[0];
+    dy2 = v[7] - v[1];
+    dz2 = v[8] - v[2];
+    area = dx1 * dy2 - dx2 * dy1;
+    if (!(area > 0 || area < 0)) return;
+
+    /* Depth plane z = a x + b y + c, raised to its farthest over a texel */
+    a = (dz1 * dy2 - dz2 * dy1) / area;
+    b = (dx1 * dz2 - dx2 * dz1) / area;
+    c = v[2] - a * v[0] - b * v[1] + 0.5f * (fabsf(a) + fabsf(b));
+
+    /*
+     * Each edge bounds the spans on the right (1) or on the left (-1),
+     * whichever way the triangle faces, at both the top and the bottom of
+     * the row. Flat edges lie above the first or below the last row and
+     * bound nothing
+     */
+    for (i = 0; i < 3; i++) {
+        j = (i + 1) % 3;
+        dy1 = v[3 * j + 1] - v[3 * i + 1];
+        side[i] = (dy1 == 0) ? 0 : ((dy1 > 0) == (area > 0)) ? 1 : -1;
+        slope[i] = (dy1 == 0) ? 0 : (v[3 * j] - v[3 * i]) / dy1;
+    }
+
+    for (y = ya; y <= yb; y++) {
+        py = y + 0.5f;
+        lo = 0;
+        hi = OCCLUDE_WIDTH;
+        for (i = 0; i < 3; i++) {
+            for (j = 0; j < 2; j++) {
+                x = v[3 * i] + slope[i] * (y + j - v[3 * i + 1]);
+                if (side[i] > 0 && x < hi) hi = x;
+                if (side[i] < 0 && x > lo) lo = x;
+            }
+        }
+
+        xa = (int)ceilf(lo);
+        xb = (int)floorf(hi) - 1;
+        row = depth + y * OCCLUDE_WIDTH;
+        z = c + b * py + a * 0.5f;
+        occludeSpan(row, xa, xb, z, a);
+    }
+}
+
+/*
+ * Keep in row[xa] to row[xb] the nearer of what they hold and z + a * x,
+ * four texels at a time with SSE2. Both paths give the same bits
+ */
+void
+occludeSpan(float *row, int xa, int xb, float z, float a)
+{
+#ifdef __SSE2__
+    __m128i x, four;
+    __m128 vz, va;
+
+    x = _mm_setr_epi32(xa, xa + 1, xa + 2, xa + 3);
+    four = _mm_set1_epi32(4);
+    vz = _mm_set1_ps(z);
+    va = _mm_set1_ps(a);
+    for (; xa + 3 <= xb; xa += 4) {
+        _mm_storeu_ps(row + xa, _mm_min_ps(_mm_add_ps(vz, _mm_mul_ps(va, _mm_cvtepi32_ps(x))),
+                                           _mm_loadu_ps(row + xa)));
+        x = _mm_add_epi32(x, four);
+    }
+#endif
+    for (; xa <= xb; xa++)
+        row[xa] = (z + a * xa < row[xa]) ? z + a * xa : row[xa];
+}
+
+/*
+ * Every texel of a level keeps the farthest of the texels below it
+ */
+void
+occludePyramid(Occlusion *o)
+{
+    const float *src;
+    float *dst, z;
+    int l, x, y, width, height, srcWidth, srcHeight, i, j;
+
+    for (l = 1; l < OCCLUDE_LEVELS; l++) {
+        src = o->level[l - 1];
+        dst = o->level[l];
+        width = LEVEL_WIDTH(l);
+        height = LEVEL_HEIGHT(l);
+        srcWidth = LEVEL_WIDTH(l - 1);
+        srcHeight = LEVEL_HEIGHT(l - 1);
+
+        for (y = 0; y < height; y++) {
+            for (x = 0; x < width; x++) {
+                z = -INFINITY;
+                for (j = 2 * y; j < 2 * y + 2 && j < srcHeight; j++)
+                    for (i = 2 * x; i < 2 * x + 2 && i < srcWidth; i++)
+                        if (src[j * srcWidth + i] > z) z = src[j * srcWidth + i];
+                dst[y * width + x] = z;
+            }
+        }
+    }
+}
+
+/*
+ * Biggest first
+ */
+int
+candidateCompare(const void *a, const void *b)
+{
+    float sa = ((const struct OccludeCandidate *)a)->size;
+    float sb = ((const struct OccludeCandidate *)b)->size;
+
+    return (sa < sb) - (sa > sb);
+}
@@ -0,0 +1,53 @@
+/*
+ * This file is part of mverse
+ * Copyright (C) 2022  juanvalencia.xyz
+
+ * mverse is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __OCCLUDE__
+#define __OCCLUDE__
+
+#include "linear.h"
+#include "obj.h"
+#include "cull.h"
+
+#define OCCLUDE_WIDTH 256           /* depth buffer size, powers of two */
+#define OCCLUDE_HEIGHT 128
+#define OCCLUDE_LEVELS 9            /* pyramid levels down to 1 x 1 */
+#define OCCLUDE_TRIANGLES 32768     /* occluder triangles drawn per frame */
+#define OCCLUDE_SIZE 0.05f          /* smallest radius over distance of an occluder */
+
+/*
+ * Software depth buffer of the biggest meshes on screen and its pyramid,
+ * every texel of a level holds the farthest depth of the 4 below it.
+ * Depths are the normalized device z of the frame clip matrix
+ */
+typedef struct {
+    Mat4 clip;
+    float *level[OCCLUDE_LEVELS];
+    struct OccludeCandidate *candidates;
+    struct OccludeRange *ranges;
+    struct OccludeThread *threads;
+    struct OccludePool *pool;           /* workers, NULL with one thread */
+    unsigned int rangeSize, triangles;  /* occluders drawn in the last frame */
+    int nThreads;
+} Occlusion;
+
+Occlusion occludeCreate(const Obj *obj, int nThreads);
+void occludeRender(Occlusion *o, const Obj *obj, const Frustum *frustum);
+int occludeBox(const Occlusion *o, const float *min, const float *max);
+int occludeSphere(const Occlusion *o, const float *center, float radius);
+void occludeFree(Occlusion *o);
+#endif
@@ -18,12 +18,34 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <GL/glew.h>
 #include "shader.h"
 
+/*
+ * Uniform locations of a program, filled once after linking. Open
+ * addressing on the uniform name, a NULL name marks an empty slot
+ */
+struct Uniform {
+    char *name;
+    int location;
+};
+
+struct UniformTable {
+    unsigned int program;
+    struct Uniform *slots;
+    unsigned int capacity;
+};
+
+static struct UniformTable *tables;
+static unsigned int tableSize;
+
 static char *getShaderSource(const char *shaderPath);
 static void checkShaderCompile(unsigned int shader, const char *shaderPath);
 static void checkProgramLink(unsigned int shader);
+static void uniformTableCreate(unsigned int program);
+static void uniformTableAdd(struct UniformTable *table, const char *name, int location);
+static unsigned int uniformHash(const char *name);
 
 char *
 getShaderSource(const char *shaderPath)
@@ -115,42 +137,164 @@ shaderCreateProgram(const char *vertexShaderPath, const char *fragmentShaderPath
     free(vertexShaderSource);
     free(fragmentShaderSource);
 
+    uniformTableCreate(shaderProgram);
     return shaderProgram;
 }
 
+/*
+ * Return the location of uniformVariable in program, or -1 when the
+ * program has no such active uniform. Resolve the locations once and keep
+ * them, this does not call into OpenGL but still hashes the name
+ */
+int
+shaderUniform(unsigned int program, const char *uniformVariable)
+{
+    struct UniformTable *table;
+    unsigned int i, mask;
+
+    for (table = tables; table < tables + tableSize; table++) {
+        if (table->program != program) continue;
+
+        mask = table->capacity - 1;
+        for (i = uniformHash(uniformVariable) & mask; table->slots[i].name; i = (i + 1) & mask) {
+            if (!strcmp(table->slots[i].name, uniformVariable))
+                return table->slots[i].location;
+        }
+        return -1;
+    }
+    return -1;
+}
+
+/*
+ * Attach the uniform block blockName of program to a binding point, the
+ * programs that bind the same point share the buffer attached to it.
+ * Programs without the block are left alone
+ */
+void
+shaderBindBlock(unsigned int program, const char *blockName, unsigned int binding)
+{
+    unsigned int index = glGetUniformBlockIndex(program, blockName);
+    if (index != GL_INVALID_INDEX)
+        glUniformBlockBinding(program, index, binding);
+}
+
+/*
+ * Ask the linked program for its active uniforms and index their
+ * locations by name. Arrays are also stored by their bare name and every
+ * element, so "lights", "lights[0]" and "lights[3]" all resolve
+ */
 void
-shaderSetfv(
-        unsigned int program,
-        char *uniformVariable,
-        float *data,
-        void (*uniform_callback)(int, int, const float *))
+uniformTableCreate(unsigned int program)
+{
+    struct UniformTable *table;
+    int i, j, count, size, maxLength, location;
+    unsigned int type, capacity;
+    char *name, *element;
+    size_t length;
+
+    glGetProgramiv(program, GL_ACTIVE_UNIFORMS, &count);
+    glGetProgramiv(program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+
+    tables = (struct UniformTable *)realloc(tables, (tableSize + 1) * sizeof(struct UniformTable));
+    name = (char *)malloc(maxLength + 1);
+    element = (char *)malloc(maxLength + 16);
+    if (tables == NULL || name == NULL || element == NULL) {
+        perror("uniformTableCreate() Error");
+        exit(1);
+    }
+
+    /* Room for the array elements too, counted below */
+    for (i = 0, capacity = count; i < count; i++) {
+        glGetActiveUniform(program, i, maxLength + 1, NULL, &size, &type, name);
+        if (size > 1) capacity += size;
+    }
+
+    table = tables + tableSize++;
+    table->program = program;
+    for (table->capacity = 16; table->capacity < 2 * capacity; table->capacity *= 2);
+    table->slots = (struct Uniform *)calloc(table->capacity, sizeof(struct Uniform));
+    if (table->slots == NULL) {
+        perror("uniformTableCreate() Error");
+        exit(1);
+    }
+
+    for (i = 0; i < count; i++) {
+        glGetActiveUniform(program, i, maxLength + 1, NULL, &size, &type, name);
+        location = glGetUniformLocation(program, name);
+        if (location == -1) continue;   /* lives in a uniform block */
+
+        uniformTableAdd(table, name, location);
+
+        length = strlen(name);
+        if (length < 3 || strcmp(name + length - 3, "[0]")) continue;
+        name[length - 3] = '\0';
+        uniformTableAdd(table, name, location);
+
+        for (j = 1; j < size; j++) {
+            sprintf(element, "%s[%d]", name, j);
+            uniformTableAdd(table, element, glGetUniformLocation(program, element));
+        }
+    }
+
+    free(name);
+    free(element);
+}
+
+void
+uniformTableAdd(struct UniformTable *table, const char *name, int location)
+{
+    unsigned int i, mask = table->capacity - 1;
+
+    for (i = uniformHash(name) & mask; table->slots[i].name; i = (i + 1) & mask) {
+        if (!strcmp(table->slots[i].name, name)) return;
+    }
+
+    table->slots[i].name = (char *)malloc(strlen(name) + 1);
+    if (table->slots[i].name == NULL) {
+        perror("uniformTableAdd() Error");
+        exit(1);
+    }
+    strcpy(table->slots[i].name, name);
+    table->slots[i].location = location;
+}
+
+/*
+ * FNV-1a
+ */
+unsigned int
+uniformHash(const char *name)
 {
-    unsigned int varLoc = glGetUniformLocation(program, uniformVariable);
-    uniform_callback(varLoc, 1, data);
+    unsigned int h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h;
 }
 
+void
+shaderSetfv(int location, float *data, void (*uniform_callback)(int, int, const float *))
+{
+    uniform_callback(location, 1, data);
+}
 
 void
 shaderSetMatrixfv(
-        unsigned int program,
-        char *uniformVariable,
+        int location,
         float *data,
         void (*uniform_callback)(int, int, unsigned char, const float *))
 {
-    unsigned int varLoc = glGetUniformLocation(program, uniformVariable);
-    uniform_callback(varLoc, 1, GL_TRUE, data);
+    uniform_callback(location, 1, GL_TRUE, data);
 }
 
 void
-shaderSet1f(unsigned int program, char *uniformVariable, float data)
+shaderSet1f(int location, float data)
 {
-    unsigned int varLoc = glGetUniformLocation(program, uniformVariable);
-    glUniform1f(varLoc, data);
+    glUniform1f(location, data);
 }
 
 void
-shaderSet1i(unsigned int program, char *uniformVariable, int data)
+shaderSet1i(int location, int data)
 {
-    unsigned int varLoc = glGetUniformLocation(program, uniformVariable);
-    glUniform1i(varLoc, data);
+    glUniform1i(location, data);
 }
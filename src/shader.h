@@ -20,18 +20,16 @@
 #define __SHADER__
 
 unsigned int shaderCreateProgram(const char *vertexShaderPath, const char *fragmentShaderPath);
-void shaderSetfv(
-        unsigned int program,
-        char *uniformVariable,
-        float *data,
-        void (*uniform_callback)(int, int, const float *));
+int shaderUniform(unsigned int program, const char *uniformVariable);
+void shaderBindBlock(unsigned int program, const char *blockName, unsigned int binding);
+
+void shaderSetfv(int location, float *data, void (*uniform_callback)(int, int, const float *));
 
 void shaderSetMatrixfv(
-        unsigned int program,
-        char *uniformVariable,
+        int location,
         float *data,
         void (*uniform_callback)(int, int, unsigned char, const float *));
 
-void shaderSet1f(unsigned int program, char *uniformVariable, float data);
-void shaderSet1i(unsigned int program, char *uniformVariable, int data);
+void shaderSet1f(int location, float data);
+void shaderSet1i(int location, int data);
 #endif
@@ -0,0 +1,365 @@
+/*
+ * This file is part of mverse
+ * Copyright (C) 2022  juanvalencia.xyz
+
+ * mverse is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+
+#include <GL/glew.h>
+
+#include "meshopt.h"
+#include "upload.h"
+
+#define UPLOAD_MAP (GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT)
+
+/*
+ * Mesh waiting for its data, those in the frustum go first and then the
+ * ones that look biggest
+ */
+struct UploadCandidate {
+    int inside;
+    float size;
+    unsigned int mesh;
+};
+
+static size_t uploadMesh(Upload *u, Obj *obj, unsigned int mesh, size_t budget);
+static size_t uploadPages(Upload *u, const Obj *obj, unsigned int mesh, size_t budget);
+static size_t uploadDraws(Upload *u, const Obj *obj, unsigned int mesh, size_t budget);
+static void drawWrite(const Upload *u, const Obj *obj, unsigned int draw, size_t from, size_t bytes, char *out);
+static void *uploadMap(GLenum target, size_t offset, size_t bytes);
+static size_t drawBytes(const Obj *obj, unsigned int draw);
+static unsigned int drawMesh(const Obj *obj, unsigned int draw);
+static int candidateCompare(const void *a, const void *b);
+
+/*
+ * Plan writing obj->vertices into the VBO, packed in the box of the unpack
+ * transform when packed is set, and the indices sources[i] points to into
+ * the EBO where obj->draws says. The VBO and EBO must have their storage,
+ * sources is freed once all is written. budget is in bytes per frame
+ */
+Upload
+uploadCreate(Obj *obj, int packed, const unsigned int **sources, size_t budget)
+{
+    Upload u;
+    const Mesh *mesh;
+    size_t stride = (packed) ? sizeof(PackedVertex) : sizeof(Vertex);
+    unsigned int i, j, first, last, pageSize;
+
+    memset(&u, 0, sizeof(u));
+    u.sources = sources;
+    u.packed = packed;
+    u.stride = stride;
+    u.budget = budget;
+
+    pageSize = (obj->vertexSize + UPLOAD_PAGE - 1) / UPLOAD_PAGE;
+    u.firstPage = (unsigned int *)malloc((obj->size + 1) * sizeof(unsigned int));
+    u.lastPage = (unsigned int *)malloc((obj->size + 1) * sizeof(unsigned int));
+    u.step = (unsigned int *)calloc(obj->size + 1, sizeof(unsigned int));
+    u.drawFirst = (unsigned int *)calloc(obj->size + 2, sizeof(unsigned int));
+    u.drawOrder = (unsigned int *)malloc((obj->draws.size + 1) * sizeof(unsigned int));
+    u.offset = (size_t *)calloc(obj->size + 1, sizeof(size_t));
+    u.pages = (unsigned char *)calloc(pageSize + 1, 1);
+    u.candidates = (struct UploadCandidate *)malloc((obj->size + 1) * sizeof(struct UploadCandidate));
+    obj->meshResident = (unsigned char *)calloc(obj->size + 1, 1);
+    if (u.firstPage == NULL || u.lastPage == NULL || u.step == NULL || u.drawFirst == NULL
+        || u.drawOrder == NULL || u.offset == NULL || u.pages == NULL || u.candidates == NULL
+        || obj->meshResident == NULL) {
+        perror("uploadCreate() Error");
+        exit(1);
+    }
+
+    /* Vertex pages each mesh reaches, counted once in the pending bytes */
+    for (i = 0; i < obj->size; i++) {
+        mesh = obj->mesh + i;
+        first = UINT_MAX;
+        last = 0;
+        for (j = mesh->indexOffset; j < mesh->indexOffset + mesh->indexSize; j++) {
+            if (obj->indices[j] < first) first = obj->indices[j];
+            if (obj->indices[j] > last) last = obj->indices[j];
+        }
+        if (!mesh->indexSize) {
+            obj->meshResident[i] = 1;
+            first = last = 0;
+        }
+        u.firstPage[i] = first / UPLOAD_PAGE;
+        u.lastPage[i] = last / UPLOAD_PAGE;
+
+        for (j = u.firstPage[i]; j <= u.lastPage[i] && mesh->indexSize; j++) {
+            if (u.pages[j]) continue;
+            u.pages[j] = 1;
+            u.pending += stride * ((j + 1 == pageSize) ? obj->vertexSize - j * UPLOAD_PAGE : UPLOAD_PAGE);
+        }
+    }
+    memset(u.pages, 0, pageSize);
+
+    /* Counting sort of the draws by mesh */
+    for (i = 0; i < obj->draws.size; i++) {
+        u.drawFirst[drawMesh(obj, i) + 2]++;
+        u.pending += drawBytes(obj, i);
+    }
+    for (i = 2; i < obj->size + 2; i++)
+        u.drawFirst[i] += u.drawFirst[i - 1];
+    for (i = 0; i < obj->draws.size; i++)
+        u.drawOrder[u.drawFirst[drawMesh(obj, i) + 1]++] = i;
+
+    return u;
+}
+
+/*
+ * Write up to the budget of bytes for the meshes waiting, in the order of
+ * struct UploadCandidate. Print the totals once all is written
+ */
+void
+uploadFrame(Upload *u, Obj *obj, const Frustum *frustum)
+{
+    struct UploadCandidate *c = u->candidates;
+    struct timespec t0, t1;
+    const Mesh *mesh;
+    unsigned int i, j, size;
+    size_t bytes;
+    float d, distance;
+
+    if (!u->pending) return;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    for (i = size = 0; i < obj->size; i++) {
+        if (obj->meshResident[i]) continue;
+        mesh = obj->mesh + i;
+        for (j = 0, distance = 0; j < 3; j++) {
+            d = mesh->center[j] - frustum->eye.vector[j];
+            distance += d * d;
+        }
+        distance = sqrtf(distance);
+        c[size].inside = !cullBox(frustum, mesh->min, mesh->max);
+        c[size].size = (distance > mesh->radius) ? mesh->radius / distance : INFINITY;
+        c[size++].mesh = i;
+    }
+    qsort(c, size, sizeof(struct UploadCandidate), candidateCompare);
+
+    glBindBuffer(GL_ARRAY_BUFFER, obj->VBO);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, obj->EBO);
+    for (i = bytes = 0; i < size && bytes < u->budget; i++)
+        bytes += uploadMesh(u, obj, c[i].mesh, u->budget - bytes);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    u->seconds += (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    u->pending -= bytes;
+    u->done += bytes;
+    u->frames++;
+    if (u->pending) return;
+
+    fprintf(stderr, "uploadFrame(): %.1f MB in %u frames, %.3f s writing, %.0f MB/s\n",
+            u->done / 1e6, u->frames, u->seconds, (u->seconds > 0) ? u->done / 1e6 / u->seconds : 0);
+    uploadFree(u);
+}
+
+/*
+ * Free the plan of u, what is not written yet stays undefined
+ */
+void
+uploadFree(Upload *u)
+{
+    free(u->sources);
+    free(u->firstPage);
+    free(u->lastPage);
+    free(u->step);
+    free(u->drawFirst);
+    free(u->drawOrder);
+    free(u->offset);
+    free(u->pages);
+    free(u->candidates);
+    memset(u, 0, sizeof(*u));
+}
+
+/*
+ * Carry on writing the pages and draws of mesh, up to budget bytes, and
+ * return how many went. Pages go whole, draws may be cut
+ */
+size_t
+uploadMesh(Upload *u, Obj *obj, unsigned int mesh, size_t budget)
+{
+    unsigned int pages, end;
+    size_t bytes, chunk;
+
+    pages = u->lastPage[mesh] - u->firstPage[mesh] + 1;
+    end = pages + u->drawFirst[mesh + 1] - u->drawFirst[mesh];
+    for (bytes = 0; u->step[mesh] < end && bytes < budget; bytes += chunk) {
+        chunk = 0;
+        if (u->step[mesh] < pages && u->pages[u->firstPage[mesh] + u->step[mesh]]) {
+            u->step[mesh]++;
+            continue;
+        }
+        chunk = (u->step[mesh] < pages)
+            ? uploadPages(u, obj, mesh, budget - bytes)
+            : uploadDraws(u, obj, mesh, budget - bytes);
+
+        /* The GL lost the store, what was written goes again next frame */
+        if (!chunk) break;
+    }
+
+    if (u->step[mesh] == end) obj->meshResident[mesh] = 1;
+    return bytes;
+}
+
+/*
+ * Write the run of missing vertex pages of mesh from its step on, until
+ * the budget is reached, through one mapping of the VBO. Return the bytes
+ * written, 0 when they were lost
+ */
+size_t
+uploadPages(Upload *u, const Obj *obj, unsigned int mesh, size_t budget)
+{
+    unsigned int pages, step, page, first, count, i;
+    char *out;
+
+    pages = u->lastPage[mesh] - u->firstPage[mesh] + 1;
+    step = u->step[mesh];
+    first = (u->firstPage[mesh] + step) * UPLOAD_PAGE;
+    for (count = 0; step < pages && !u->pages[u->firstPage[mesh] + step] && count * u->stride < budget; step++) {
+        page = u->firstPage[mesh] + step;
+        count += (obj->vertexSize - page * UPLOAD_PAGE < UPLOAD_PAGE) ? obj->vertexSize - page * UPLOAD_PAGE : UPLOAD_PAGE;
+    }
+    out = (char *)uploadMap(GL_ARRAY_BUFFER, first * u->stride, count * u->stride);
+    if (u->packed)
+        meshoptPack(obj, first, count, obj->unpackOffset, obj->unpackScale, (PackedVertex *)out);
+    else
+        memcpy(out, obj->vertices + first, count * sizeof(Vertex));
+
+    if (!glUnmapBuffer(GL_ARRAY_BUFFER)) return 0;
+
+    for (i = first / UPLOAD_PAGE; i <= (first + count - 1) / UPLOAD_PAGE; i++)
+        u->pages[i] = 1;
+    u->step[mesh] = step;
+    return count * u->stride;
+}
+
+/*
+ * Write the draws of mesh from its step on that follow each other in the
+ * EBO, until the budget is reached, through one mapping of the EBO. The
+ * last one is cut on whole indices. Return the bytes written, 0 when they
+ * were lost
+ */
+size_t
+uploadDraws(Upload *u, const Obj *obj, unsigned int mesh, size_t budget)
+{
+    unsigned int pages, end, step, first, draw, i;
+    size_t index, start, offset, from, size, chunk, bytes;
+    char *out;
+
+    pages = u->lastPage[mesh] - u->firstPage[mesh] + 1;
+    end = pages + u->drawFirst[mesh + 1] - u->drawFirst[mesh];
+    first = u->drawFirst[mesh] + u->step[mesh] - pages;
+    index = (u->drawOrder[first] < obj->draws.shortSize) ? sizeof(unsigned short) : sizeof(unsigned int);
+    start = (size_t)obj->draws.offset[u->drawOrder[first]] + u->offset[mesh];
+
+    step = u->step[mesh];
+    offset = u->offset[mesh];
+    for (bytes = 0; step < end && bytes < budget; ) {
+        draw = u->drawOrder[u->drawFirst[mesh] + step - pages];
+        if ((size_t)obj->draws.offset[draw] + offset != start + bytes
+            || (draw < obj->draws.shortSize) != (index == sizeof(unsigned short)))
+            break;
+        size = drawBytes(obj, draw) - offset;
+        chunk = (budget - bytes) / index * index;
+        if (chunk == 0) chunk = index;
+        if (chunk > size) chunk = size;
+        bytes += chunk;
+        offset += chunk;
+        if (chunk < size) break;
+        offset = 0;
+        step++;
+    }
+
+    out = (char *)uploadMap(GL_COPY_WRITE_BUFFER, start, bytes);
+    for (i = u->step[mesh], from = u->offset[mesh], size = 0; size < bytes; i++, from = 0) {
+        draw = u->drawOrder[u->drawFirst[mesh] + i - pages];
+        chunk = drawBytes(obj, draw) - from;
+        if (chunk > bytes - size) chunk = bytes - size;
+        drawWrite(u, obj, draw, from, chunk, out + size);
+        size += chunk;
+    }
+
+    if (!glUnmapBuffer(GL_COPY_WRITE_BUFFER)) return 0;
+
+    u->step[mesh] = step;
+    u->offset[mesh] = offset;
+    return bytes;
+}
+
+/*
+ * Write bytes of the EBO image of draw from byte from on, 16 bit draws are
+ * relative to their base vertex
+ */
+void
+drawWrite(const Upload *u, const Obj *obj, unsigned int draw, size_t from, size_t bytes, char *out)
+{
+    const unsigned int *in = u->sources[draw];
+    unsigned short *shorts = (unsigned short *)out;
+    size_t i;
+
+    if (draw >= obj->draws.shortSize) {
+        memcpy(out, (const char *)in + from, bytes);
+        return;
+    }
+    in += from / sizeof(unsigned short);
+    for (i = 0; i < bytes / sizeof(unsigned short); i++)
+        shorts[i] = in[i] - obj->draws.base[draw];
+}
+
+void *
+uploadMap(GLenum target, size_t offset, size_t bytes)
+{
+    void *out;
+
+    /* Nothing draws from a range before it is written, so no need to sync */
+    out = glMapBufferRange(target, offset, bytes, UPLOAD_MAP);
+    if (out == NULL) {
+        fprintf(stderr, "uploadMap() Error: can't map %zu bytes of the buffer\n", bytes);
+        exit(1);
+    }
+    return out;
+}
+
+size_t
+drawBytes(const Obj *obj, unsigned int draw)
+{
+    return obj->draws.count[draw] * ((draw < obj->draws.shortSize) ? sizeof(unsigned short) : sizeof(unsigned int));
+}
+
+unsigned int
+drawMesh(const Obj *obj, unsigned int draw)
+{
+    return (obj->meshlet) ? obj->meshlet[obj->drawSource[draw]].mesh : obj->drawSource[draw];
+}
+
+int
+candidateCompare(const void *a, const void *b)
+{
+    const struct UploadCandidate *ca = (const struct UploadCandidate *)a;
+    const struct UploadCandidate *cb = (const struct UploadCandidate *)b;
+
+    if (ca->inside != cb->inside) return cb->inside - ca->inside;
+    return (ca->size < cb->size) - (ca->size > cb->size);
+}
@@ -0,0 +1,52 @@
+/*
+ * This file is part of mverse
+ * Copyright (C) 2022  juanvalencia.xyz
+
+ * mverse is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef __UPLOAD__
+#define __UPLOAD__
+
+#include <stddef.h>
+
+#include "obj.h"
+#include "cull.h"
+
+#define UPLOAD_BUDGET 32        /* default megabytes copied to GL per frame */
+#define UPLOAD_PAGE 4096        /* vertices copied together */
+
+/*
+ * Vertex and index data still to be written into the VBO and EBO of an Obj,
+ * straight from obj->vertices and the indices each draw comes from. A mesh
+ * needs the vertex pages its indices reach and all its draws, its step
+ * counts those done and offset the bytes of the draw being written
+ */
+typedef struct {
+    const unsigned int **sources;   /* indices of each draw of obj->draws */
+    int packed;                     /* the VBO holds PackedVertex */
+    size_t stride, budget, pending, done;
+    unsigned int *firstPage, *lastPage, *step;
+    unsigned int *drawFirst, *drawOrder;    /* draws of mesh m, from drawFirst[m] to drawFirst[m + 1] */
+    size_t *offset;
+    unsigned char *pages;
+    struct UploadCandidate *candidates;
+    unsigned int frames;
+    double seconds;                 /* spent writing */
+} Upload;
+
+Upload uploadCreate(Obj *obj, int packed, const unsigned int **sources, size_t budget);
+void uploadFrame(Upload *u, Obj *obj, const Frustum *frustum);
+void uploadFree(Upload *u);
+#endif
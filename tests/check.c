@@ -0,0 +1,340 @@
+/*
+ * This file is part of mverse
+ * Copyright (C) 2022  juanvalencia.xyz
+
+ * mverse is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks of the obj loader that need no GL, run by make check: the
+ * parallel parse must give the same Obj as the serial one and parseFloat()
+ * the same floats as strtof(). obj.c is included to reach its statics
+ */
+
+#include "../src/obj.c"
+
+#define CHECK_BYTES (9 << 20)       /* generated obj, several OBJ_CHUNK_MIN */
+#define CHECK_THREADS 8
+#define CHECK_FLOATS 1000000        /* random strings given to parseFloat() */
+
+static uint64_t checkRandom(void);
+static void checkWriteObj(const char *path, const char *dir);
+static void checkWriteMtl(const char *path, int library);
+static void checkWriteFloat(FILE *f);
+static int checkParse(const char *path);
+static int checkSame(const char *what, const void *a, const void *b, size_t size);
+static int checkFloats(void);
+static int checkFloat(const char *s);
+
+static uint64_t state = UINT64_C(0x9e3779b97f4a7c15);
+
+int
+main(int argc, char *argv[])
+{
+    char path[4096];
+    int failed;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: check directory\n");
+        exit(2);
+    }
+
+    snprintf(path, sizeof(path), "%s/check.obj", argv[1]);
+    checkWriteObj(path, argv[1]);
+    failed = checkParse(path);
+    failed |= checkFloats();
+
+    fprintf(stderr, "check: %s\n", (failed) ? "FAILED" : "ok");
+    return failed;
+}
+
+/*
+ * xorshift64*, the same numbers on every platform
+ */
+uint64_t
+checkRandom(void)
+{
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * UINT64_C(2685821657736338717);
+}
+
+/*
+ * Write at least CHECK_BYTES of obj to path with everything the parser
+ * knows: two mtllib files, usemtl switches, unknown materials, groups,
+ * comments, CRLF lines, every face format, polygons and faces with fewer
+ * than 3 corners
+ */
+void
+checkWriteObj(const char *path, const char *dir)
+{
+    static const char *materials[] = {"red", "green", "blue", "missing", "stone"};
+    char mtl[4096];
+    unsigned int nVertices, i, j, n, k, form;
+    long size;
+    FILE *f;
+
+    snprintf(mtl, sizeof(mtl), "%s/check.mtl", dir);
+    checkWriteMtl(mtl, 0);
+    snprintf(mtl, sizeof(mtl), "%s/check2.mtl", dir);
+    checkWriteMtl(mtl, 1);
+
+    f = fopen(path, "w");
+    if (f == NULL) {
+        perror("checkWriteObj() Error");
+        exit(1);
+    }
+
+    fprintf(f, "# generated by make check\nmtllib check.mtl\n");
+    nVertices = 0;
+    for (size = 0; size < CHECK_BYTES; size = ftell(f)) {
+        switch (checkRandom() % 16) {
+            case 0:
+                fprintf(f, "usemtl %s\n", materials[checkRandom() % 5]);
+                break;
+            case 1:
+                fprintf(f, (checkRandom() % 2) ? "g part%u\r\n" : "o object%u\n", (unsigned int)(checkRandom() % 100));
+                break;
+            case 2:
+                if (checkRandom() % 50 == 0) fprintf(f, "mtllib check2.mtl\n");
+                else fprintf(f, "# comment %u\n\n", (unsigned int)(checkRandom() % 1000));
+                break;
+            case 3: case 4: case 5: case 6: case 7:
+                for (i = 0; i < 4; i++, nVertices++) {
+                    fprintf(f, "v");
+                    for (j = 0; j < 3; j++) checkWriteFloat(f);
+                    fprintf(f, "\nvn");
+                    for (j = 0; j < 3; j++) checkWriteFloat(f);
+                    fprintf(f, "\nvt");
+                    for (j = 0; j < 2; j++) checkWriteFloat(f);
+                    fprintf(f, "\n");
+                }
+                break;
+            default:
+                if (nVertices < 3) break;
+                n = (checkRandom() % 10 == 0) ? checkRandom() % 3 : 3 + checkRandom() % 3;
+                form = checkRandom() % 4;
+                fprintf(f, "f");
+                for (i = 0; i < n; i++) {
+                    /* Mostly the latest vertices, as exporters write them */
+                    k = (checkRandom() % 4) ? nVertices - checkRandom() % ((nVertices < 16) ? nVertices : 16)
+                                            : 1 + checkRandom() % nVertices;
+                    fprintf(f, " %u", k);
+                    if (form == 1) fprintf(f, "/%u", k);
+                    if (form == 2) fprintf(f, "//%u", k);
+                    if (form == 3) fprintf(f, "/%u/%u", k, k);
+                }
+                fprintf(f, "\n");
+        }
+    }
+    fclose(f);
+}
+
+void
+checkWriteMtl(const char *path, int library)
+{
+    FILE *f;
+
+    f = fopen(path, "w");
+    if (f == NULL) {
+        perror("checkWriteMtl() Error");
+        exit(1);
+    }
+    if (library) {
+        fprintf(f, "newmtl stone\nKa 0.1 0.1 0.1\nKd 0.5 0.5 0.45\nKs 0 0 0\nNs 10\nillum 1\n");
+    } else {
+        fprintf(f, "newmtl red\nKd 1 0 0\nNs 32\nillum 2\n\n");
+        fprintf(f, "newmtl green\nKd 0 1 0\nKs 0.5 0.5 0.5\n\n");
+        fprintf(f, "newmtl blue\r\nKd 0 0 1\r\n");
+    }
+    fclose(f);
+}
+
+/*
+ * One coordinate in one of the ways exporters write them
+ */
+void
+checkWriteFloat(FILE *f)
+{
+    double x = ((double)(checkRandom() % 2000001) - 1000000) / ((checkRandom() % 3) ? 1000.0 : 7.0);
+
+    switch (checkRandom() % 4) {
+        case 0: fprintf(f, " %.6f", x); break;
+        case 1: fprintf(f, " %g", x); break;
+        case 2: fprintf(f, " %.4e", x); break;
+        default: fprintf(f, " %.17g", x);
+    }
+}
+
+/*
+ * Parse path serially and with CHECK_THREADS threads, return 1 when the
+ * two Obj differ
+ */
+int
+checkParse(const char *path)
+{
+    Obj serial, parallel;
+    int failed = 0;
+
+    serial = objCreate(path, 1);
+    parallel = objCreate(path, CHECK_THREADS);
+
+    if (serial.vertexSize != parallel.vertexSize || serial.indexSize != parallel.indexSize
+        || serial.size != parallel.size || serial.materialSize != parallel.materialSize
+        || serial.nameSize != parallel.nameSize || serial.librarySize != parallel.librarySize) {
+        fprintf(stderr, "checkParse(): sizes differ: %u/%u vertices, %u/%u indices, %u/%u meshes, %u/%u materials\n",
+                serial.vertexSize, parallel.vertexSize, serial.indexSize, parallel.indexSize,
+                serial.size, parallel.size, serial.materialSize, parallel.materialSize);
+        failed = 1;
+    } else {
+        failed |= checkSame("vertices", serial.vertices, parallel.vertices, serial.vertexSize * sizeof(Vertex));
+        failed |= checkSame("indices", serial.indices, parallel.indices, serial.indexSize * sizeof(unsigned int));
+        failed |= checkSame("meshes", serial.mesh, parallel.mesh, serial.size * sizeof(Mesh));
+        failed |= checkSame("materials", serial.material, parallel.material, serial.materialSize * sizeof(Material));
+        failed |= checkSame("names", serial.names, parallel.names, serial.nameSize);
+        failed |= checkSame("libraries", serial.libraries, parallel.libraries, serial.librarySize);
+    }
+    if (serial.indexSize == 0 || serial.size < 2 || serial.materialSize < 2) {
+        fprintf(stderr, "checkParse(): the generated file left too little to compare\n");
+        failed = 1;
+    }
+
+    fprintf(stderr, "checkParse(): %u vertices, %u indices, %u meshes, %u materials, %s\n",
+            serial.vertexSize, serial.indexSize, serial.size, serial.materialSize, (failed) ? "differ" : "same");
+    objDestroy(&serial);
+    objDestroy(&parallel);
+    return failed;
+}
+
+int
+checkSame(const char *what, const void *a, const void *b, size_t size)
+{
+    if (size && memcmp(a, b, size)) {
+        fprintf(stderr, "checkParse(): the %s differ\n", what);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Give parseFloat() hand picked strings, random ones with long mantissas
+ * and exponents, mantissas past 2^53 and numbers halfway between two
+ * floats. Return 1 on any difference with strtof()
+ */
+int
+checkFloats(void)
+{
+    static const char *fixed[] = {
+        "0", "-0", "+0", "0.0e5", "-0.0", ".5", "5.", "-.5e1", "1e+5", "1e", "1e+", "e5", "+", "-", ".",
+        "1e38", "3.4028235e38", "3.40282356e38", "3.4028236e38", "1e39", "1e-38", "1.17549435e-38",
+        "1.1754942e-38", "1e-45", "1.4e-45", "7e-46", "1e-46", "1e-50", "1e400", "1e-400",
+        "16777216", "16777217", "16777218", "16777219", "33554431", "33554433", "33554435",
+        "9007199254740992", "9007199254740993", "9007199254740993e-10", "18014398509481985",
+        "0.1", "0.2", "0.3", "1.0000000596046448", "1.00000005960464477539062", "1.0000000596046447753906250001",
+        "00000000000000000000001.5", "0.00000000000000000000000000000000000001", "123456789012345678901234567890",
+        "1234567890123456789012345678901234567890e-30", "0.1234567890123456789012345678901234567890",
+        "inf", "-inf", "nan", "infinity", "1.5x", "1.5/2", "2e5e5", "1e00000000000000000005", "1e-0000000000000007"
+    };
+    char s[128];
+    unsigned int i, j, n, failures = 0, count = 0;
+    float f, g;
+    double mid;
+
+    for (i = 0; i < sizeof(fixed) / sizeof(fixed[0]); i++, count++)
+        failures += checkFloat(fixed[i]);
+
+    for (i = 0; i < CHECK_FLOATS; i++, count++) {
+        n = 0;
+        if (checkRandom() % 4 == 0) s[n++] = '-';
+        for (j = 1 + checkRandom() % 40; j > 0; j--) {
+            if (j == 1 + checkRandom() % 20 && checkRandom() % 4) s[n++] = '.';
+            s[n++] = '0' + checkRandom() % 10;
+        }
+        if (checkRandom() % 2)
+            n += sprintf(s + n, "e%d", (int)(checkRandom() % 101) - 50);
+        s[n] = '\0';
+        failures += checkFloat(s);
+    }
+
+    /* Between 2^53 and 10^17 the digits no longer fit the exact path */
+    for (i = 0; i < CHECK_FLOATS / 10; i++, count++) {
+        sprintf(s, "%llu", (unsigned long long)(UINT64_C(9007199254740992) + checkRandom() % UINT64_C(90992800745259008)));
+        if (checkRandom() % 2) sprintf(s + strlen(s), "e%d", (int)(checkRandom() % 45) - 22);
+        failures += checkFloat(s);
+    }
+
+    /*
+     * Halfway between a float and the next one, and just either side. From
+     * 2^-12 to 2^56 the halfway points are short enough to write exactly
+     */
+    for (i = 0; i < CHECK_FLOATS / 10; i++) {
+        f = ldexpf(1 + (float)(checkRandom() % (1 << 23)) / (1 << 23), (int)(checkRandom() % 69) - 12);
+        g = nextafterf(f, INFINITY);
+        mid = ((double)f + g) / 2;
+        if (mid >= 1e17) continue;
+        if (mid == floor(mid)) {
+            for (j = 0; j < 3; j++, count++) {
+                sprintf(s, "%llu", (unsigned long long)mid + j - 1);
+                failures += checkFloat(s);
+            }
+        } else {
+            sprintf(s, "%.40f", mid);
+            for (n = strlen(s); s[n - 1] == '0'; n--);
+            s[n] = '\0';
+            failures += checkFloat(s);
+            strcat(s, "1");
+            failures += checkFloat(s);
+            s[n - 1]--;
+            failures += checkFloat(s);
+            count += 3;
+        }
+        /* Rounded to 15 and 16 digits, where the double is often the tie */
+        for (j = 14; j < 16; j++, count++) {
+            sprintf(s, "%.*e", (int)j, mid);
+            failures += checkFloat(s);
+        }
+        sprintf(s, "%.9g", f);
+        failures += checkFloat(s);
+        count++;
+    }
+
+    fprintf(stderr, "checkFloats(): %u strings, %u differ from strtof()\n", count, failures);
+    return failures != 0;
+}
+
+/*
+ * Return 1 when parseFloat() and strtof() disagree on s, in value bits or
+ * in where the number ends
+ */
+int
+checkFloat(const char *s)
+{
+    const char *end = s + strlen(s), *parsed;
+    char *expectedEnd;
+    float value, expected;
+    uint32_t a, b;
+
+    value = 0;
+    parsed = parseFloat(s, end, &value);
+    expected = strtof(s, &expectedEnd);
+    if (expectedEnd == s) return parsed != NULL;
+
+    memcpy(&a, &value, sizeof(a));
+    memcpy(&b, &expected, sizeof(b));
+    if (parsed == expectedEnd && a == b) return 0;
+
+    fprintf(stderr, "checkFloat(): \"%s\" gives %.9g, strtof() %.9g\n", s, value, expected);
+    return 1;
+}